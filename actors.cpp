@@ -0,0 +1,256 @@
+#include "actors.h"                   // アクターとスレッドプール
+#include "vm.h"                       // コマンドとスクリプトの実行
+
+// ---- アクター(1つのプログラムをそれぞれの実行状態で動かす、NPCなどのスクリプト) ----
+
+// 自分のキューか、他のスレッドのキューから仕事を1つ取る
+bool take_task(WorkerPool& pool, std::size_t self, std::pair<std::uint32_t, std::uint32_t>& task) {
+  {
+    WorkerQueue& own = *pool.queues[self];
+    std::lock_guard<std::mutex> lock(own.mutex);
+    if (!own.tasks.empty()) {
+      task = own.tasks.front();
+      own.tasks.pop_front();
+      return true;
+    }
+  }
+  for (std::size_t i = 1; i < pool.queues.size(); i++) {
+    WorkerQueue& other = *pool.queues[(self + i) % pool.queues.size()];
+    std::lock_guard<std::mutex> lock(other.mutex);
+    if (!other.tasks.empty()) {
+      task = other.tasks.back();
+      other.tasks.pop_back();
+      return true;
+    }
+  }
+  return false;
+}
+
+// 取れる仕事が無くなるまで実行する
+void run_worker_tasks(WorkerPool& pool, std::size_t self) {
+  std::pair<std::uint32_t, std::uint32_t> task;
+  while (take_task(pool, self, task)) {
+    pool.job(pool.context, task.first, task.second);
+    if (pool.remaining.fetch_sub(1) == 1) {
+      std::lock_guard<std::mutex> lock(pool.mutex);
+      pool.done.notify_all();
+    }
+  }
+}
+
+void worker_main(WorkerPool& pool, std::size_t self) {
+  std::uint64_t seen = 0;
+  while (1) {
+    {
+      std::unique_lock<std::mutex> lock(pool.mutex);
+      pool.wake.wait(lock, [&] { return pool.stopping || pool.generation != seen; });
+      if (pool.stopping) return;
+      seen = pool.generation;
+    }
+    run_worker_tasks(pool, self);
+  }
+}
+
+// threads個のスレッドを立ち上げる(0ならメインスレッドだけで実行する)
+void start_worker_pool(WorkerPool& pool, unsigned threads) {
+  pool.generation = 0;
+  pool.remaining = 0;
+  pool.stopping = false;
+  for (unsigned i = 0; i <= threads; i++) pool.queues.emplace_back(new WorkerQueue);
+  for (unsigned i = 1; i <= threads; i++) pool.threads.emplace_back(worker_main, std::ref(pool), i);
+}
+
+void stop_worker_pool(WorkerPool& pool) {
+  {
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    pool.stopping = true;
+  }
+  pool.wake.notify_all();
+  for (auto& thread : pool.threads) thread.join();
+  pool.threads.clear();
+  pool.queues.clear();
+}
+
+// 0からcount-1の番号をchunk個ずつに分けてjobを並列に実行し、全て終わるまで待つ
+void run_parallel(WorkerPool& pool, WorkerJob job, void* context, std::uint32_t count, std::uint32_t chunk) {
+  if (count == 0) return;
+  pool.job = job;
+  pool.context = context;
+  std::uint32_t tasks = (count + chunk - 1) / chunk;
+  pool.remaining = tasks;
+  for (std::uint32_t t = 0; t < tasks; t++) {
+    WorkerQueue& queue = *pool.queues[t % pool.queues.size()];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    queue.tasks.emplace_back(t * chunk, std::min(count, (t + 1) * chunk));
+  }
+  {
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    pool.generation += 1;
+  }
+  pool.wake.notify_all();
+  run_worker_tasks(pool, 0);
+  std::unique_lock<std::mutex> lock(pool.mutex);
+  pool.done.wait(lock, [&] { return pool.remaining == 0; });
+}
+
+void index_actor_program(ActorPool& pool, const Program& program) {
+  pool.program = &program;
+  pool.sprite_stride = program.symbols.size();
+  pool.text_stride = program.strings.size();
+  pool.actor_id_symbol = -1;
+  for (std::size_t i = 0; i < program.symbols.size(); i++) {
+    if (program.symbols[i] == "actor_id") pool.actor_id_symbol = i;
+  }
+}
+
+void init_actor_pool(ActorPool& pool, const Program& program, unsigned threads) {
+  if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+  pool.threads = threads - 1; // メインスレッドも仕事をする
+  pool.started = false;
+  pool.profiler = Profiler{};
+  pool.next_actor_id = 0;
+  index_actor_program(pool, program);
+}
+
+void destroy_actor_pool(ActorPool& pool) {
+  if (pool.started) stop_worker_pool(pool.workers);
+  pool.actors.clear();
+}
+
+// targetから実行するアクターを作る(MAX_ACTORSに達していれば作らずにfalseを返す)
+bool spawn_actor(ActorPool& pool, EngineState& main_state, std::uint32_t target) {
+  if (pool.actors.size() >= MAX_ACTORS) return false;
+  if (!pool.started) {
+    start_worker_pool(pool.workers, pool.threads);
+    pool.started = true;
+  }
+  const Program& program = *pool.program;
+  std::unique_ptr<EngineState> actor(new EngineState{});
+  actor->assets = main_state.assets;
+  actor->variables.assign(program.symbols.size(), 0.0);
+  actor->executed_frames.assign(program.code.size(), 0);
+  init_sprites(actor->sprites, program.symbols.size());
+  init_texts(actor->texts, program.strings.size());
+  actor->command_index = target;
+  actor->parallel = true;
+  if (main_state.instruction_budget > 0) actor->instruction_budget = REPLAY_ACTOR_STEP_INSTRUCTIONS;
+  if (pool.actor_id_symbol >= 0) actor->variables[pool.actor_id_symbol] = pool.next_actor_id;
+  pool.next_actor_id += 1;
+  pool.actors.push_back(std::move(actor));
+  set_metric(METRIC_ACTORS, pool.actors.size());
+
+  std::size_t groups = pool.actors.size() + 1;
+  main_state.sprites.slot_of.resize(groups * pool.sprite_stride, -1);
+  main_state.texts.slot_of.resize(groups * pool.text_stride, -1);
+  return true;
+}
+
+void drop_actor_output(ActorPool& pool, EngineState& main_state, std::uint32_t main_sprite_ids) {
+  std::size_t groups = pool.actors.size() + 1;
+  SpriteStore old_sprites = std::move(main_state.sprites);
+  init_sprites(main_state.sprites, groups * pool.sprite_stride);
+  for (std::size_t slot = 0; slot < old_sprites.ids.size(); slot++) {
+    if (old_sprites.ids[slot] >= main_sprite_ids) continue;
+    set_sprite(main_state.sprites, old_sprites.ids[slot], old_sprites.regions[slot], old_sprites.rects[slot], old_sprites.z[slot]);
+  }
+  TextStore old_texts = std::move(main_state.texts);
+  init_texts(main_state.texts, groups * pool.text_stride);
+  for (std::size_t slot = 0; slot < old_texts.strings.size(); slot++) {
+    // メインのスクリプトの文字列はキーが文字列プールのインデックスそのもの
+    if (old_texts.slot_of[old_texts.strings[slot]] == static_cast<std::int32_t>(slot)) {
+      set_text(main_state.texts, old_texts.strings[slot], old_texts.strings[slot], old_texts.positions[slot]);
+    }
+  }
+  for (auto& actor : pool.actors) actor->sprites.changed = true;
+}
+
+// 前回までに命令列の終わりまで実行したアクター(待っているものは除く)を取り除く
+// 残りのアクターは番号が詰まるので、メインの表示に合成した画像と文字列を作り直す
+void retire_finished_actors(ActorPool& pool, EngineState& main_state) {
+  const std::size_t end = pool.program->code.size();
+  auto finished = [end](const std::unique_ptr<EngineState>& actor) {
+    return actor->command_index >= end && actor->wait_frames == 0;
+  };
+  auto first = std::remove_if(pool.actors.begin(), pool.actors.end(), finished);
+  if (first == pool.actors.end()) return;
+  pool.actors.erase(first, pool.actors.end());
+  set_metric(METRIC_ACTORS, pool.actors.size());
+  drop_actor_output(pool, main_state, pool.sprite_stride);
+}
+
+// スレッドプールで実行する仕事(アクターbeginからend-1までを1回ずつ実行する)
+void step_actor_range(void* context, std::uint32_t begin, std::uint32_t end) {
+  ActorPool& pool = *static_cast<ActorPool*>(context);
+  for (std::uint32_t i = begin; i < end; i++) {
+    EngineState& actor = *pool.actors[i];
+    actor.input = *pool.input;
+    run_script(pool.renderer, actor, *pool.program, ACTOR_SCRIPT_BUDGET_US, pool.profiler);
+  }
+}
+
+// 並列実行中に使われた画像を、メインのスクリプトが使ったときと同じようにキャッシュに知らせる
+void note_texture_use(EngineState& main_state, std::uint32_t path_index, std::vector<std::uint32_t>& requests) {
+  TextureCache& cache = main_state.assets->texture_cache;
+  cache.last_used[path_index] = ++cache.clock;
+  if (main_state.assets->textures[path_index].tex != NULL) {
+    cache.hits += 1;
+    return;
+  }
+  cache.misses += 1;
+  if (!cache.requested[path_index] && !cache.missing[path_index]) {
+    cache.requested[path_index] = 1;
+    requests.push_back(path_index);
+  }
+}
+
+void step_actors(ActorPool& pool, SDL_Renderer* renderer, EngineState& main_state) {
+  retire_finished_actors(pool, main_state);
+  pool.renderer = renderer;
+  pool.input = &main_state.input;
+  run_parallel(pool.workers, step_actor_range, &pool, pool.actors.size(), ACTOR_CHUNK_SIZE);
+
+  std::vector<std::uint32_t> spawns;
+  spawns.swap(main_state.spawn_requests);
+  std::vector<std::uint32_t> requests;
+  for (std::size_t i = 0; i < pool.actors.size(); i++) {
+    EngineState& actor = *pool.actors[i];
+    if (main_state.assets->texture_cache.enabled) {
+      for (std::uint32_t path_index : actor.texture_requests) note_texture_use(main_state, path_index, requests);
+    }
+    actor.texture_requests.clear();
+    spawns.insert(spawns.end(), actor.spawn_requests.begin(), actor.spawn_requests.end());
+    actor.spawn_requests.clear();
+
+    std::uint32_t sprite_base = (i + 1) * pool.sprite_stride;
+    if (actor.sprites.changed) {
+      const SpriteStore& sprites = actor.sprites;
+      for (std::size_t slot = 0; slot < sprites.ids.size(); slot++) {
+        set_sprite(main_state.sprites, sprite_base + sprites.ids[slot], sprites.regions[slot], sprites.rects[slot], sprites.z[slot]);
+      }
+      actor.sprites.changed = false;
+    }
+    std::uint32_t text_base = (i + 1) * pool.text_stride;
+    for (std::size_t slot = 0; slot < actor.texts.strings.size(); slot++) {
+      std::uint32_t string_index = actor.texts.strings[slot];
+      if (set_text(main_state.texts, text_base + string_index, string_index, actor.texts.positions[slot])) {
+        main_state.sprites.changed = true;
+      }
+    }
+  }
+
+  if (!requests.empty()) {
+    TexturePrefetcher& prefetcher = main_state.assets->texture_cache.prefetcher;
+    {
+      std::lock_guard<std::mutex> lock(prefetcher.mutex);
+      prefetcher.queue.insert(prefetcher.queue.end(), requests.rbegin(), requests.rend());
+    }
+    prefetcher.wake.notify_one();
+  }
+  std::size_t rejected = 0;
+  for (std::uint32_t target : spawns) {
+    if (!spawn_actor(pool, main_state, target)) rejected += 1;
+  }
+  if (rejected > 0) {
+    std::cerr << "'spawn': too many actors (at most " << MAX_ACTORS << "), " << rejected << " not created." << std::endl;
+  }
+}
@@ -0,0 +1,68 @@
+// アクターとスレッドプール
+#ifndef ACTORS_H
+#define ACTORS_H
+
+#include "engine.h"                   // エンジン全体で使う型と定数
+#include "profiler.h"                 // フレーム時間とプロファイラ
+
+// スレッドごとの仕事のキュー(仕事はアクターの番号の範囲)
+struct WorkerQueue {
+  std::mutex mutex;
+  std::deque<std::pair<std::uint32_t, std::uint32_t>> tasks;
+};
+
+using WorkerJob = void (*)(void* context, std::uint32_t begin, std::uint32_t end);
+
+// 仕事を盗み合うスレッドプール
+// 各スレッドは自分のキューの先頭から仕事を取り、空になったら他のスレッドのキューの末尾から盗む
+// 0番のキューは仕事を渡したメインスレッド自身が受け持つ
+struct WorkerPool {
+  std::vector<std::unique_ptr<WorkerQueue>> queues;
+  std::vector<std::thread> threads;
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::condition_variable done;
+  std::uint64_t generation;           // 仕事を渡すたびに進める
+  std::atomic<std::size_t> remaining; // 終わっていない仕事の数
+  bool stopping;
+  WorkerJob job;
+  void* context;
+};
+
+// アクターの一覧と、それを動かすスレッドプール
+// アクターはプログラムと画像を共有し、実行位置・変数・表示中の画像をそれぞれ持つ
+// 命令列の終わりまで実行したアクターは次のstep_actorsで取り除き、後ろのアクターの番号を詰める
+// アクターの画像と文字列は、実行後にアクターの番号順でメインの表示に合成するので結果はスレッド数によらない
+// (合成するときのidはアクターの番号+1にシンボル・文字列の数を掛けたものを足す)
+struct ActorPool {
+  std::vector<std::unique_ptr<EngineState>> actors;
+  WorkerPool workers;
+  unsigned threads;          // スレッドプールのスレッド数
+  bool started;
+  const Program* program;
+  SDL_Renderer* renderer;
+  const InputState* input;
+  std::int64_t actor_id_symbol; // アクターの番号を入れる変数actor_idのシンボル(無ければ-1)
+  std::uint32_t next_actor_id;  // 次に作るアクターのactor_id(取り除いたアクターの番号は使い回さない)
+  std::uint32_t sprite_stride;  // 合成するときのidの間隔
+  std::uint32_t text_stride;
+  Profiler profiler{};          // 無効のまま使う(アクターの命令ごとの時間は測らない)
+};
+
+// アクターのidの間隔と変数actor_idをプログラムに合わせる
+void index_actor_program(ActorPool& pool, const Program& program);
+
+// threadsが0ならCPUのコア数に合わせる。スレッドは最初のアクターを作るときに立ち上げる
+void init_actor_pool(ActorPool& pool, const Program& program, unsigned threads);
+
+void destroy_actor_pool(ActorPool& pool);
+
+// 全てのアクターを1回ずつ並列に実行し、結果をアクターの番号順にメインの状態へ合成する
+// spawnで頼まれたアクターはMAX_ACTORSまで作り、超えた分は作らずに報告する
+void step_actors(ActorPool& pool, SDL_Renderer* renderer, EngineState& main_state);
+
+// メインの表示からアクターの画像と文字列を取り除き、今のアクターの数とidの間隔で表を作り直す
+// idがmain_sprite_idsより小さい画像とメインのスクリプトの文字列は残し、アクターの分は次のstep_actorsで合成し直す
+void drop_actor_output(ActorPool& pool, EngineState& main_state, std::uint32_t main_sprite_ids);
+
+#endif // ACTORS_H
@@ -0,0 +1,768 @@
+#include "assets.h"                   // 画像の読み込みとテクスチャの管理
+#include "script.h"                   // スクリプトの解釈とコンパイル
+#include "metrics.h"                  // 運用中の計測値
+#include <fcntl.h>                    // 画像のアーカイブを開きたい
+#include <sys/mman.h>                 // 画像のアーカイブをmmapしたい
+#include <sys/stat.h>                 // ファイルの大きさを知りたい
+#include <unistd.h>                   // ファイルを閉じたい
+
+// ファイルの存在を確認する
+inline bool exists_file (const char* name) {
+    std::ifstream f(name);
+    return f.good();
+}
+
+TextureRegion make_region(SDL_Texture* tex, SDL_Rect src, int tex_w, int tex_h) {
+  return TextureRegion{tex, src,
+                       static_cast<float>(src.x) / tex_w, static_cast<float>(src.y) / tex_h,
+                       static_cast<float>(src.x + src.w) / tex_w, static_cast<float>(src.y + src.h) / tex_h};
+}
+
+// ---- ベイク済み画像 ----
+// 画像を描画する形式の画素に変換したものをファイルに書いておき、実行時はデコードせずに読むだけにする
+// ファイル名は元の画像の中身と変換の内容から求めたハッシュなので、変わった画像だけを作り直せばよい
+// ヘッダの後に1行ずつ詰めた画素が続く
+
+const char BAKED_IMAGE_MAGIC[4] = {'E', 'G', 'E', 'B'};
+const std::uint32_t BAKED_IMAGE_VERSION = 1;
+
+struct BakedImageHeader {
+  char magic[4];
+  std::uint32_t version;
+  std::uint32_t format; // SDL_PIXELFORMAT_*
+  std::uint32_t w, h;
+};
+
+// メモリ上のベイク済み画像から画素を写す(形式が違うなどで読めなければNULL)
+SDL_Surface* decode_baked_image(const char* data, std::size_t size) {
+  BakedImageHeader header;
+  if (size < sizeof(header)) return NULL;
+  std::memcpy(&header, data, sizeof(header));
+  if (std::memcmp(header.magic, BAKED_IMAGE_MAGIC, sizeof(header.magic)) != 0 || header.version != BAKED_IMAGE_VERSION ||
+      header.format != BAKED_PIXEL_FORMAT || size - sizeof(header) < static_cast<std::uint64_t>(header.w) * header.h * 4) {
+    return NULL;
+  }
+  SDL_Surface* surface = SDL_CreateRGBSurfaceWithFormat(0, header.w, header.h, 32, header.format);
+  if (surface == NULL) return NULL;
+  const char* pixels = data + sizeof(header);
+  for (std::uint32_t y = 0; y < header.h; y++) {
+    std::memcpy(static_cast<char*>(surface->pixels) + y * surface->pitch, pixels + static_cast<std::size_t>(y) * header.w * 4, header.w * 4);
+  }
+  return surface;
+}
+
+// ベイク済み画像のファイルを読む
+SDL_Surface* load_baked_image(const std::string& path) {
+  std::optional<std::string> data = load_txt(path);
+  if (!data) return NULL;
+  return decode_baked_image(data->data(), data->size());
+}
+
+std::uint64_t hash_bytes(std::uint64_t hash, const void* data, std::size_t size) {
+  const unsigned char* bytes = static_cast<const unsigned char*>(data);
+  for (std::size_t i = 0; i < size; i++) {
+    hash ^= bytes[i];
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+// 画像パスのハッシュ(アーカイブの索引に使う)
+inline std::uint64_t hash_path(std::string_view path) {
+  return hash_bytes(FNV_OFFSET_BASIS, path.data(), path.size());
+}
+
+bool load_asset_archive(AssetArchive& archive, const std::string& path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || static_cast<std::size_t>(st.st_size) < sizeof(AssetArchiveHeader)) {
+    close(fd);
+    return false;
+  }
+  std::size_t size = st.st_size;
+  void* addr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) return false;
+  std::shared_ptr<const void> storage(addr, [size](const void* p) { munmap(const_cast<void*>(p), size); });
+
+  const char* base = static_cast<const char*>(addr);
+  AssetArchiveHeader header;
+  std::memcpy(&header, base, sizeof(header));
+  if (std::memcmp(header.magic, ASSET_ARCHIVE_MAGIC, sizeof(header.magic)) != 0 || header.version != ASSET_ARCHIVE_VERSION ||
+      header.byte_order != 0x01020304 ||
+      (size - sizeof(header)) / sizeof(AssetArchiveEntry) < header.entry_count) {
+    return false;
+  }
+  const AssetArchiveEntry* entries = reinterpret_cast<const AssetArchiveEntry*>(base + sizeof(header));
+  for (std::uint32_t i = 0; i < header.entry_count; i++) {
+    const AssetArchiveEntry& entry = entries[i];
+    if (entry.offset > size || entry.size > size - entry.offset ||
+        entry.path_offset > size || entry.path_size > size - entry.path_offset ||
+        (i > 0 && entries[i - 1].path_hash > entry.path_hash)) {
+      return false;
+    }
+  }
+  archive.storage = std::move(storage);
+  archive.base = base;
+  archive.size = size;
+  archive.entries = entries;
+  archive.entry_count = header.entry_count;
+  return true;
+}
+
+// 画像パスの索引を二分探索する(無ければNULL)
+const AssetArchiveEntry* find_archive_entry(const AssetArchive& archive, std::string_view path) {
+  if (archive.entries == NULL) return NULL;
+  std::uint64_t hash = hash_path(path);
+  const AssetArchiveEntry* end = archive.entries + archive.entry_count;
+  const AssetArchiveEntry* found = std::lower_bound(archive.entries, end, hash, [](const AssetArchiveEntry& entry, std::uint64_t h) {
+    return entry.path_hash < h;
+  });
+  for (; found != end && found->path_hash == hash; found++) {
+    if (std::string_view(archive.base + found->path_offset, found->path_size) == path) return found;
+  }
+  return NULL;
+}
+
+SDL_Surface* load_image(const ImageSources& sources, const char* image_path) {
+  ENGINE_ZONE("load_image");
+  if (const AssetArchiveEntry* entry = find_archive_entry(sources.archive, image_path)) {
+    const char* data = sources.archive.base + entry->offset;
+    if (entry->kind == ARCHIVE_BAKED) return decode_baked_image(data, entry->size);
+    return IMG_Load_RW(SDL_RWFromConstMem(data, static_cast<int>(entry->size)), 1);
+  }
+  auto found = sources.baked.files.find(std::string_view(image_path));
+  if (found != sources.baked.files.end()) {
+    SDL_Surface* surface = load_baked_image(found->second);
+    if (surface != NULL) return surface;
+    std::cerr << "baked image: " << found->second << " could not be loaded." << std::endl;
+  }
+  // 存在を確かめるためだけに開き直さず、無ければIMG_LoadがNULLを返す
+  return IMG_Load(image_path);
+}
+
+bool load_baked_assets(BakedAssets& baked, const std::string& dir) {
+  std::ifstream ifs(dir + "/index.txt");
+  if (!ifs) return false;
+  std::string line;
+  while (std::getline(ifs, line)) {
+    std::size_t tab = line.find('\t');
+    if (tab == std::string::npos) continue;
+    baked.files[line.substr(0, tab)] = dir + "/" + line.substr(tab + 1);
+  }
+  return true;
+}
+
+// 先読みスレッドの処理(依頼された画像を1枚ずつデコードする)
+void texture_prefetch_worker(TexturePrefetcher& prefetcher, const Program& program, const ImageSources& sources) {
+  std::unique_lock<std::mutex> lock(prefetcher.mutex);
+  while (1) {
+    prefetcher.wake.wait(lock, [&] { return prefetcher.stopping || !prefetcher.queue.empty(); });
+    if (prefetcher.stopping) break;
+    std::uint32_t path_index = prefetcher.queue.back();
+    prefetcher.queue.pop_back();
+
+    // ホットリロードでprogramが差し替えられても良いよう、パスはロック中に写しておく
+    std::string image_path(program.strings[path_index]);
+    lock.unlock();
+    SDL_Surface* surface = load_image(sources, image_path.c_str());
+    lock.lock();
+
+    prefetcher.decoded.emplace_back(path_index, surface);
+  }
+}
+
+void index_next_images(TextureCache& cache, const Program& program) {
+  cache.next_image.assign(program.code.size() + 1, program.code.size());
+  for (std::size_t i = program.code.size(); i-- > 0;) {
+    cache.next_image[i] = program.code[i].op == IMAGE ? i : cache.next_image[i + 1];
+  }
+}
+
+// 命令の位置を含むシーン
+inline std::uint32_t scene_of(const SceneGraph& scenes, std::size_t pos) {
+  return std::upper_bound(scenes.starts.begin(), scenes.starts.end(), pos) - scenes.starts.begin() - 1;
+}
+
+// ラベルでシーンに区切り、各シーンからdepth回の移動以内に辿り着くシーンの画像を幅優先探索で集める
+// ifやinputで呼んだ先からはreturnで戻るので、呼んだ側のシーンの続きは素通りで辿る
+void analyze_scenes(SceneGraph& scenes, const Program& program, int depth) {
+  scenes.starts.assign(1, 0);
+  for (std::size_t i = 1; i < program.code.size(); i++) {
+    if (program.code[i].op == LABEL) scenes.starts.push_back(i);
+  }
+  std::size_t count = scenes.starts.size();
+
+  // シーンごとの画像と移動先
+  std::vector<std::vector<std::uint32_t>> images(count), next(count);
+  for (std::size_t scene = 0; scene < count; scene++) {
+    std::size_t begin = scenes.starts[scene];
+    std::size_t end = scene + 1 < count ? scenes.starts[scene + 1] : program.code.size();
+    for (std::size_t i = begin; i < end; i++) {
+      const Instruction& inst = program.code[i];
+      if (inst.op == IMAGE) images[scene].push_back(program.operands[inst.operand_begin + 1].index);
+      int pos = label_operand_position(inst);
+      if (pos < 0) continue;
+      const Operand& target = program.operands[inst.operand_begin + pos];
+      if (target.kind == OPERAND_LABEL && target.index < program.code.size()) next[scene].push_back(scene_of(scenes, target.index));
+    }
+    bool falls_through = end == begin || (program.code[end - 1].op != GOTO && program.code[end - 1].op != RETURN);
+    if (falls_through && scene + 1 < count) next[scene].push_back(scene + 1);
+  }
+
+  scenes.asset_begin.assign(1, 0);
+  scenes.assets.clear();
+  // 探索の印は出発したシーンの番号にして、シーンごとに消さずに済ませる
+  std::vector<std::uint32_t> visited(count, UINT32_MAX);
+  std::vector<std::uint32_t> added(program.strings.size(), UINT32_MAX);
+  std::vector<std::uint32_t> frontier, following;
+  for (std::uint32_t scene = 0; scene < count; scene++) {
+    frontier.assign(1, scene);
+    visited[scene] = scene;
+    for (int d = 0; d <= depth && !frontier.empty(); d++) {
+      following.clear();
+      for (std::uint32_t from : frontier) {
+        for (std::uint32_t path_index : images[from]) {
+          if (added[path_index] == scene) continue;
+          added[path_index] = scene;
+          scenes.assets.push_back(path_index);
+        }
+        for (std::uint32_t to : next[from]) {
+          if (visited[to] == scene) continue;
+          visited[to] = scene;
+          following.push_back(to);
+        }
+      }
+      frontier.swap(following);
+    }
+    scenes.asset_begin.push_back(scenes.assets.size());
+  }
+}
+
+void index_scenes(TextureCache& cache, const Program& program) {
+  analyze_scenes(cache.scenes, program, cache.scene_depth);
+  cache.current_scene = UINT32_MAX;
+  cache.reachable.assign(program.strings.size(), 0);
+}
+
+void init_texture_cache(TextureCache& cache, const Program& program, const ImageSources& sources, std::size_t budget_mb, int scene_depth) {
+  cache.enabled = true;
+  cache.budget_bytes = budget_mb * 1024 * 1024;
+  cache.resident_bytes = 0;
+  cache.clock = 0;
+  cache.last_used.assign(program.strings.size(), 0);
+  cache.bytes.assign(program.strings.size(), 0);
+  cache.requested.assign(program.strings.size(), 0);
+  cache.missing.assign(program.strings.size(), 0);
+  cache.hits = cache.misses = 0;
+  index_next_images(cache, program);
+  cache.scene_depth = scene_depth;
+  index_scenes(cache, program);
+
+  cache.prefetcher.worker = std::thread(texture_prefetch_worker, std::ref(cache.prefetcher), std::cref(program), std::cref(sources));
+}
+
+void destroy_texture_cache(TextureCache& cache, EngineState& state) {
+  if (!cache.enabled) return;
+  {
+    std::lock_guard<std::mutex> lock(cache.prefetcher.mutex);
+    cache.prefetcher.stopping = true;
+  }
+  cache.prefetcher.wake.notify_one();
+  cache.prefetcher.worker.join();
+  for (auto& entry : cache.prefetcher.decoded) {
+    if (entry.second != NULL) SDL_FreeSurface(entry.second);
+  }
+  for (std::uint32_t path_index : cache.resident) {
+    SDL_DestroyTexture(state.assets->textures[path_index].tex);
+    state.assets->textures[path_index] = TextureRegion{};
+  }
+  cache.resident.clear();
+}
+
+// 上限に収まるまで、表示中でないテクスチャを最後に使われたのが古い順に捨てる
+// 表示中の画像のテクスチャを並べて返す(フレームの一時領域に置く)
+SDL_Texture** textures_in_use(EngineState& state, std::size_t& count) {
+  count = state.sprites.regions.size();
+  SDL_Texture** in_use = scratch_alloc<SDL_Texture*>(state.assets->texture_cache.scratch, count);
+  for (std::size_t i = 0; i < count; i++) in_use[i] = state.sprites.regions[i].tex;
+  std::sort(in_use, in_use + count);
+  return in_use;
+}
+
+// 常駐している画像を1つ捨てる(residentからは呼び出し側で取り除く)
+void drop_texture(TextureCache& cache, EngineState& state, std::uint32_t path_index) {
+  SDL_DestroyTexture(state.assets->textures[path_index].tex);
+  state.assets->textures[path_index] = TextureRegion{};
+  cache.resident_bytes -= cache.bytes[path_index];
+  cache.bytes[path_index] = 0;
+  cache.requested[path_index] = 0;
+}
+
+void evict_textures(TextureCache& cache, EngineState& state, std::size_t incoming) {
+  if (cache.resident_bytes + incoming <= cache.budget_bytes) return;
+
+  std::size_t in_use_count;
+  SDL_Texture** in_use = textures_in_use(state, in_use_count);
+
+  // 今のシーンから辿り着く画像を先に、その中では新しく使われた順に並べ、末尾から捨てていく
+  std::sort(cache.resident.begin(), cache.resident.end(), [&](std::uint32_t a, std::uint32_t b) {
+    if (cache.reachable[a] != cache.reachable[b]) return cache.reachable[a] > cache.reachable[b];
+    return cache.last_used[a] > cache.last_used[b];
+  });
+  std::uint32_t* kept = scratch_alloc<std::uint32_t>(cache.scratch, cache.resident.size());
+  std::size_t kept_count = 0;
+  while (!cache.resident.empty() && cache.resident_bytes + incoming > cache.budget_bytes) {
+    std::uint32_t oldest = cache.resident.back();
+    cache.resident.pop_back();
+    if (std::binary_search(in_use, in_use + in_use_count, state.assets->textures[oldest].tex)) {
+      kept[kept_count++] = oldest;
+      continue;
+    }
+    drop_texture(cache, state, oldest);
+  }
+  cache.resident.insert(cache.resident.end(), kept, kept + kept_count);
+}
+
+// シーンが変わったときに呼び、新しいシーンから辿り着かず表示もしていない画像を捨てる
+void release_unreachable_textures(TextureCache& cache, EngineState& state) {
+  std::size_t in_use_count;
+  SDL_Texture** in_use = textures_in_use(state, in_use_count);
+  std::size_t kept = 0;
+  for (std::uint32_t path_index : cache.resident) {
+    if (cache.reachable[path_index] ||
+        std::binary_search(in_use, in_use + in_use_count, state.assets->textures[path_index].tex)) {
+      cache.resident[kept++] = path_index;
+    } else {
+      drop_texture(cache, state, path_index);
+    }
+  }
+  cache.resident.resize(kept);
+}
+
+// デコード済みの画像をテクスチャにしてキャッシュに入れる(surfaceは解放する)
+void insert_texture(SDL_Renderer* renderer, EngineState& state, std::uint32_t path_index, SDL_Surface* surface) {
+  TextureCache& cache = state.assets->texture_cache;
+  if (state.assets->textures[path_index].tex != NULL) {
+    SDL_FreeSurface(surface);
+    return;
+  }
+  std::size_t size = static_cast<std::size_t>(surface->w) * surface->h * 4;
+  evict_textures(cache, state, size);
+
+  SDL_Texture* tex = SDL_CreateTextureFromSurface(renderer, surface);
+  state.assets->textures[path_index] = make_region(tex, SDL_Rect{0, 0, surface->w, surface->h}, surface->w, surface->h);
+  cache.bytes[path_index] = size;
+  cache.resident_bytes += size;
+  cache.resident.push_back(path_index);
+  SDL_FreeSurface(surface);
+}
+
+const TextureRegion& fetch_texture(SDL_Renderer* renderer, EngineState& state, const Program& program, std::uint32_t path_index) {
+  TextureCache& cache = state.assets->texture_cache;
+  const char* image_path = program.strings.c_str(path_index);
+  if (cache.missing[path_index]) return state.assets->textures[path_index];
+
+  SDL_Surface* surface = load_image(state.assets->sources, image_path);
+  if (surface == NULL) {
+    std::cerr << "file: " << image_path << " not found." << std::endl;
+    cache.missing[path_index] = 1;
+  } else {
+    insert_texture(renderer, state, path_index, surface);
+  }
+  return state.assets->textures[path_index];
+}
+
+void update_texture_cache(SDL_Renderer* renderer, EngineState& state, const Program& program) {
+  TextureCache& cache = state.assets->texture_cache;
+  if (!cache.enabled) return;
+
+  using Decoded = std::pair<std::uint32_t, SDL_Surface*>;
+  Decoded* decoded = scratch_alloc<Decoded>(cache.scratch, TEXTURE_UPLOADS_PER_FRAME);
+  std::size_t decoded_count;
+  {
+    std::lock_guard<std::mutex> lock(cache.prefetcher.mutex);
+    decoded_count = std::min<std::size_t>(TEXTURE_UPLOADS_PER_FRAME, cache.prefetcher.decoded.size());
+    std::uninitialized_copy(cache.prefetcher.decoded.begin(), cache.prefetcher.decoded.begin() + decoded_count, decoded);
+    cache.prefetcher.decoded.erase(cache.prefetcher.decoded.begin(), cache.prefetcher.decoded.begin() + decoded_count);
+  }
+  for (std::size_t k = 0; k < decoded_count; k++) {
+    const Decoded& entry = decoded[k];
+    if (entry.second == NULL) {
+      if (!cache.missing[entry.first]) {
+        std::cerr << "file: " << program.strings[entry.first] << " not found." << std::endl;
+        cache.missing[entry.first] = 1;
+      }
+      continue;
+    }
+    insert_texture(renderer, state, entry.first, entry.second);
+  }
+
+  // 実行位置が別のシーンに移ったら、そこから辿り着くシーンの画像を先読みする画像に入れ替える
+  std::uint32_t scene = scene_of(cache.scenes, std::min(state.command_index, program.code.size()));
+  std::size_t scene_begin = 0, scene_end = 0;
+  if (scene != cache.current_scene) {
+    std::fill(cache.reachable.begin(), cache.reachable.end(), 0);
+    scene_begin = cache.scenes.asset_begin[scene];
+    scene_end = cache.scenes.asset_begin[scene + 1];
+    for (std::size_t k = scene_begin; k < scene_end; k++) cache.reachable[cache.scenes.assets[k]] = 1;
+    if (cache.current_scene != UINT32_MAX) release_unreachable_textures(cache, state);
+    cache.current_scene = scene;
+  }
+
+  // 実行位置の先のimageコマンドの画像を先に、シーンの画像を後に並べる
+  std::uint32_t* requests = scratch_alloc<std::uint32_t>(cache.scratch, TEXTURE_PREFETCH_COUNT + (scene_end - scene_begin));
+  std::size_t request_count = 0;
+  auto request = [&](std::uint32_t path_index) {
+    if (state.assets->textures[path_index].tex == NULL && !cache.requested[path_index] && !cache.missing[path_index]) {
+      cache.requested[path_index] = 1;
+      requests[request_count++] = path_index;
+    }
+  };
+  std::size_t i = cache.next_image[std::min(state.command_index, program.code.size())];
+  for (int n = 0; n < TEXTURE_PREFETCH_COUNT && i < program.code.size(); n++) {
+    request(program.operands[program.code[i].operand_begin + 1].index);
+    i = cache.next_image[i + 1];
+  }
+  for (std::size_t k = scene_begin; k < scene_end; k++) request(cache.scenes.assets[k]);
+  if (request_count > 0) {
+    {
+      std::lock_guard<std::mutex> lock(cache.prefetcher.mutex);
+      // 末尾から取り出されるので、近い画像ほど後ろに積む
+      for (std::size_t k = request_count; k-- > 0;) cache.prefetcher.queue.push_back(requests[k]);
+    }
+    cache.prefetcher.wake.notify_one();
+  }
+}
+
+// アトラス上の画像の配置
+struct AtlasPlacement {
+  std::size_t image; // 配置する画像の番号
+  int page;          // 何枚目のアトラスに置くか
+  SDL_Rect rect;     // アトラス内の位置
+};
+
+// 棚詰め(shelf packing)で画像をアトラスに配置し、配置とアトラスの枚数を返す
+// 高い順に並べて左から詰め、幅が足りなくなったら次の段、高さが足りなくなったら次のアトラスに移る
+std::vector<AtlasPlacement>
+pack_atlas(const std::vector<SDL_Surface*>& images, int page_size, int& page_count)
+{
+  std::vector<std::size_t> order(images.size());
+  for (std::size_t i = 0; i < order.size(); i++) order[i] = i;
+  std::sort(order.begin(), order.end(), [&](std::size_t a, std::size_t b) {
+    return images[a]->h > images[b]->h;
+  });
+
+  std::vector<AtlasPlacement> result;
+  int shelf_x = 0, shelf_y = 0, shelf_h = 0;
+  page_count = images.empty() ? 0 : 1;
+  for (std::size_t i : order) {
+    int w = images[i]->w + ATLAS_PADDING;
+    int h = images[i]->h + ATLAS_PADDING;
+    if (shelf_x + w > page_size) {
+      shelf_x = 0;
+      shelf_y += shelf_h;
+      shelf_h = 0;
+    }
+    if (shelf_y + h > page_size) {
+      page_count += 1;
+      shelf_x = shelf_y = shelf_h = 0;
+    }
+    result.push_back(AtlasPlacement{i, page_count - 1, SDL_Rect{shelf_x, shelf_y, images[i]->w, images[i]->h}});
+    shelf_x += w;
+    shelf_h = std::max(shelf_h, h);
+  }
+  return result;
+}
+
+// アトラスの辺の長さを2の累乗に切り上げる(page_sizeは超えない)
+int round_up_page_size(int extent, int page_size) {
+  int size = 1;
+  while (size < extent) size *= 2;
+  return std::min(size, page_size);
+}
+
+void upload_textures(SDL_Renderer* renderer, EngineState& state, std::vector<SDL_Surface*>& surfaces) {
+  ENGINE_ZONE("upload");
+  SDL_RendererInfo info;
+  int page_size = ATLAS_PAGE_SIZE;
+  if (SDL_GetRendererInfo(renderer, &info) == 0 && info.max_texture_width > 0) {
+    page_size = std::min({page_size, info.max_texture_width, info.max_texture_height});
+  }
+
+  // アトラスにまとめる画像と単独でテクスチャにする画像に分ける
+  std::vector<SDL_Surface*> small_images;
+  std::vector<std::uint32_t> small_paths;
+  for (std::uint32_t path_index = 0; path_index < surfaces.size(); path_index++) {
+    SDL_Surface* surface = surfaces[path_index];
+    if (surface == NULL) continue;
+    // pack_atlasと同じく間隔を含めた大きさで比べる(アトラスの辺ちょうどの画像は置けない)
+    int limit = std::min(ATLAS_MAX_IMAGE_SIZE, page_size);
+    if (surface->w + ATLAS_PADDING <= limit && surface->h + ATLAS_PADDING <= limit) {
+      small_images.push_back(surface);
+      small_paths.push_back(path_index);
+    } else {
+      SDL_Texture* tex = SDL_CreateTextureFromSurface(renderer, surface);
+      state.assets->texture_pages.push_back(tex);
+      state.assets->textures[path_index] = make_region(tex, SDL_Rect{0, 0, surface->w, surface->h}, surface->w, surface->h);
+      add_metric(METRIC_TEXTURE_BYTES, static_cast<std::uint64_t>(surface->w) * surface->h * 4);
+    }
+  }
+
+  int page_count = 0;
+  std::vector<AtlasPlacement> placements = pack_atlas(small_images, page_size, page_count);
+
+  // アトラスは画像を詰めた範囲を2の累乗に切り上げた大きさで作る(数枚の小さな画像しか無いページを辺いっぱいに取らない)
+  std::vector<SDL_Point> page_sizes(page_count, SDL_Point{1, 1});
+  for (const auto& placement : placements) {
+    SDL_Point& extent = page_sizes[placement.page];
+    extent.x = std::max(extent.x, placement.rect.x + placement.rect.w);
+    extent.y = std::max(extent.y, placement.rect.y + placement.rect.h);
+  }
+  for (auto& extent : page_sizes) {
+    extent.x = round_up_page_size(extent.x, page_size);
+    extent.y = round_up_page_size(extent.y, page_size);
+  }
+
+  // アトラスに画像をそのまま(アルファを合成せずに)書き写してからテクスチャにする
+  std::vector<SDL_Surface*> pages(page_count);
+  for (int i = 0; i < page_count; i++) {
+    pages[i] = SDL_CreateRGBSurfaceWithFormat(0, page_sizes[i].x, page_sizes[i].y, 32, SDL_PIXELFORMAT_RGBA32);
+  }
+  for (const auto& placement : placements) {
+    SDL_Surface* image = small_images[placement.image];
+    SDL_Rect dst = placement.rect;
+    SDL_SetSurfaceBlendMode(image, SDL_BLENDMODE_NONE);
+    SDL_BlitSurface(image, NULL, pages[placement.page], &dst);
+  }
+  std::vector<SDL_Texture*> page_textures(page_count);
+  for (int i = 0; i < page_count; i++) {
+    page_textures[i] = SDL_CreateTextureFromSurface(renderer, pages[i]);
+    SDL_SetTextureBlendMode(page_textures[i], SDL_BLENDMODE_BLEND);
+    state.assets->texture_pages.push_back(page_textures[i]);
+    add_metric(METRIC_TEXTURE_BYTES, static_cast<std::uint64_t>(page_sizes[i].x) * page_sizes[i].y * 4);
+    SDL_FreeSurface(pages[i]);
+  }
+  for (const auto& placement : placements) {
+    state.assets->textures[small_paths[placement.image]] =
+      make_region(page_textures[placement.page], placement.rect, page_sizes[placement.page].x, page_sizes[placement.page].y);
+  }
+
+  for (auto& surface : surfaces) {
+    if (surface != NULL) SDL_FreeSurface(surface);
+    surface = NULL;
+  }
+}
+
+std::vector<std::uint32_t> collect_image_paths(const Program& program) {
+  std::vector<std::uint32_t> result;
+  std::vector<bool> seen(program.strings.size(), false);
+  for (const auto& inst : program.code) {
+    // imageコマンドである(引数はコンパイル時に検査済み)
+    if (inst.op != IMAGE) continue;
+    std::uint32_t path_index = program.operands[inst.operand_begin + 1].index;
+    if (seen[path_index]) continue;
+    seen[path_index] = true;
+    result.push_back(path_index);
+  }
+  return result;
+}
+
+// ワーカースレッドの処理(画像がなくなるまで1枚ずつ取ってデコードする)
+void image_loader_worker(ImageLoader& loader) {
+  ENGINE_ZONE("preload");
+  while (1) {
+    std::size_t i = loader.next.fetch_add(1);
+    if (i >= loader.paths.size()) break;
+    const char* image_path = loader.program->strings.c_str(loader.paths[i]);
+    SDL_Surface* surface = load_image(*loader.sources, image_path);
+    (*loader.surfaces)[loader.paths[i]] = surface;
+    if (surface == NULL) loader.missing[i] = 1;
+    loader.done.fetch_add(1);
+  }
+}
+
+void start_image_loader(ImageLoader& loader, const Program& program, const ImageSources& sources,
+                        std::vector<SDL_Surface*>& surfaces, unsigned threads) {
+  loader.program = &program;
+  loader.sources = &sources;
+  loader.paths = collect_image_paths(program);
+  loader.surfaces = &surfaces;
+  loader.missing.assign(loader.paths.size(), 0);
+  if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+  threads = std::min<std::size_t>(threads, std::max<std::size_t>(1, loader.paths.size()));
+  for (unsigned i = 0; i < threads; i++) {
+    loader.workers.emplace_back(image_loader_worker, std::ref(loader));
+  }
+}
+
+float image_loader_progress(const ImageLoader& loader) {
+  if (loader.paths.empty()) return 1.0f;
+  return static_cast<float>(loader.done.load()) / loader.paths.size();
+}
+
+bool image_loader_finished(const ImageLoader& loader) {
+  return loader.done.load() >= loader.paths.size();
+}
+
+void finish_image_loader(ImageLoader& loader) {
+  for (auto& worker : loader.workers) worker.join();
+  loader.workers.clear();
+  for (std::size_t i = 0; i < loader.paths.size(); i++) {
+    if (loader.missing[i]) {
+      std::cerr << "file: " << loader.program->strings[loader.paths[i]] << " not found." << std::endl;
+    }
+  }
+}
+
+// 全てのimageコマンドが同じ大きさを即値で指定している画像なら、その大きさを返す
+std::optional<SDL_Point> fixed_draw_size(const Program& program, std::uint32_t path_index) {
+  std::optional<SDL_Point> size;
+  for (const auto& inst : program.code) {
+    if (inst.op != IMAGE || program.operands[inst.operand_begin + 1].index != path_index) continue;
+    if (inst.operand_count < 6) return std::nullopt;
+    const Operand& w = program.operands[inst.operand_begin + 4];
+    const Operand& h = program.operands[inst.operand_begin + 5];
+    if (w.kind != OPERAND_NUMBER || h.kind != OPERAND_NUMBER || w.number <= 0 || h.number <= 0) return std::nullopt;
+    SDL_Point drawn{static_cast<int>(w.number), static_cast<int>(h.number)};
+    if (size && (size->x != drawn.x || size->y != drawn.y)) return std::nullopt;
+    size = drawn;
+  }
+  return size;
+}
+
+// 画像をBAKED_PIXEL_FORMATに変換し(sizeがあればその大きさに縮小・拡大して)ファイルに書く
+bool write_baked_image(const std::string& path, SDL_Surface* image, std::optional<SDL_Point> size) {
+  SDL_Surface* converted = SDL_ConvertSurfaceFormat(image, BAKED_PIXEL_FORMAT, 0);
+  if (converted == NULL) return false;
+  if (size && (size->x != converted->w || size->y != converted->h)) {
+    SDL_Surface* scaled = SDL_CreateRGBSurfaceWithFormat(0, size->x, size->y, 32, BAKED_PIXEL_FORMAT);
+    SDL_SetSurfaceBlendMode(converted, SDL_BLENDMODE_NONE);
+    SDL_BlitScaled(converted, NULL, scaled, NULL);
+    SDL_FreeSurface(converted);
+    converted = scaled;
+  }
+
+  BakedImageHeader header{};
+  std::memcpy(header.magic, BAKED_IMAGE_MAGIC, sizeof(header.magic));
+  header.version = BAKED_IMAGE_VERSION;
+  header.format = BAKED_PIXEL_FORMAT;
+  header.w = converted->w;
+  header.h = converted->h;
+  std::ofstream ofs(path, std::ios::binary);
+  ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  for (std::uint32_t y = 0; y < header.h; y++) {
+    ofs.write(static_cast<const char*>(converted->pixels) + y * converted->pitch, header.w * 4);
+  }
+  SDL_FreeSurface(converted);
+  return static_cast<bool>(ofs);
+}
+
+bool bake_assets(const Program& program, const std::string& dir, bool prescale) {
+  mkdir(dir.c_str(), 0755);
+  std::ofstream index(dir + "/index.txt");
+  if (!index) return false;
+  std::size_t baked = 0, reused = 0;
+  for (std::uint32_t path_index : collect_image_paths(program)) {
+    const char* image_path = program.strings.c_str(path_index);
+    std::optional<std::string> content = load_txt(image_path);
+    if (!content) {
+      std::cerr << "file: " << image_path << " not found." << std::endl;
+      continue;
+    }
+    std::optional<SDL_Point> size = prescale ? fixed_draw_size(program, path_index) : std::nullopt;
+    const std::uint32_t params[4] = {BAKED_IMAGE_VERSION, BAKED_PIXEL_FORMAT,
+                                     static_cast<std::uint32_t>(size ? size->x : 0), static_cast<std::uint32_t>(size ? size->y : 0)};
+    std::uint64_t hash = hash_bytes(FNV_OFFSET_BASIS, content->data(), content->size());
+    hash = hash_bytes(hash, params, sizeof(params));
+    char name[24];
+    std::snprintf(name, sizeof(name), "%016llx.bin", static_cast<unsigned long long>(hash));
+    std::string baked_path = dir + "/" + name;
+
+    if (exists_file(baked_path.c_str())) {
+      reused += 1;
+    } else {
+      SDL_Surface* image = IMG_Load(image_path);
+      if (image == NULL || !write_baked_image(baked_path, image, size)) {
+        std::cerr << "bake: " << image_path << " could not be baked." << std::endl;
+        if (image != NULL) SDL_FreeSurface(image);
+        continue;
+      }
+      SDL_FreeSurface(image);
+      baked += 1;
+    }
+    index << image_path << '\t' << name << '\n';
+  }
+  std::cout << "bake: " << baked << " baked, " << reused << " unchanged." << std::endl;
+  return static_cast<bool>(index);
+}
+
+bool pack_assets(const Program& program, const BakedAssets& baked, const std::string& path) {
+  struct PackedImage {
+    std::string path;
+    std::string content;
+    ArchiveEntryKind kind;
+  };
+  std::vector<PackedImage> images;
+  for (std::uint32_t path_index : collect_image_paths(program)) {
+    std::string image_path(program.strings[path_index]);
+    auto found = baked.files.find(image_path);
+    std::optional<std::string> content = load_txt(found != baked.files.end() ? found->second : image_path);
+    if (!content) {
+      std::cerr << "file: " << image_path << " not found." << std::endl;
+      continue;
+    }
+    images.push_back(PackedImage{image_path, std::move(*content), found != baked.files.end() ? ARCHIVE_BAKED : ARCHIVE_ENCODED});
+  }
+  std::sort(images.begin(), images.end(), [](const PackedImage& a, const PackedImage& b) {
+    return hash_path(a.path) < hash_path(b.path);
+  });
+
+  AssetArchiveHeader header{};
+  std::memcpy(header.magic, ASSET_ARCHIVE_MAGIC, sizeof(header.magic));
+  header.version = ASSET_ARCHIVE_VERSION;
+  header.byte_order = 0x01020304;
+  header.entry_count = images.size();
+  std::vector<AssetArchiveEntry> entries(images.size());
+  std::uint64_t offset = sizeof(header) + sizeof(AssetArchiveEntry) * entries.size();
+  for (std::size_t i = 0; i < images.size(); i++) {
+    entries[i].path_hash = hash_path(images[i].path);
+    entries[i].path_offset = offset;
+    entries[i].path_size = images[i].path.size();
+    entries[i].kind = images[i].kind;
+    offset += images[i].path.size();
+  }
+  for (std::size_t i = 0; i < images.size(); i++) {
+    offset = (offset + 7) & ~static_cast<std::uint64_t>(7);
+    entries[i].offset = offset;
+    entries[i].size = images[i].content.size();
+    offset += images[i].content.size();
+  }
+
+  std::ofstream ofs(path, std::ios::binary);
+  if (!ofs) return false;
+  ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  ofs.write(reinterpret_cast<const char*>(entries.data()), sizeof(AssetArchiveEntry) * entries.size());
+  std::uint64_t written = sizeof(header) + sizeof(AssetArchiveEntry) * entries.size();
+  for (const auto& image : images) {
+    ofs.write(image.path.data(), image.path.size());
+    written += image.path.size();
+  }
+  for (std::size_t i = 0; i < images.size(); i++) {
+    static const char zeros[8] = {};
+    ofs.write(zeros, entries[i].offset - written);
+    ofs.write(images[i].content.data(), images[i].content.size());
+    written = entries[i].offset + entries[i].size;
+  }
+  std::cout << "pack: " << images.size() << " images, " << written << " bytes." << std::endl;
+  return static_cast<bool>(ofs);
+}
+
+void update_texture_metrics(const Assets& assets) {
+  const TextureCache& cache = assets.texture_cache;
+  if (!cache.enabled) return;
+  set_metric(METRIC_TEXTURE_BYTES, cache.resident_bytes);
+  set_metric(METRIC_CACHE_HITS, cache.hits);
+  set_metric(METRIC_CACHE_MISSES, cache.misses);
+}
@@ -0,0 +1,88 @@
+// 画像の読み込みとテクスチャの管理
+#ifndef ASSETS_H
+#define ASSETS_H
+
+#include "engine.h"                   // エンジン全体で使う型と定数
+
+// テクスチャ内の領域を作る
+TextureRegion make_region(SDL_Texture* tex, SDL_Rect src, int tex_w, int tex_h);
+
+// FNV-1aでハッシュを求める
+std::uint64_t hash_bytes(std::uint64_t hash, const void* data, std::size_t size);
+
+const std::uint64_t FNV_OFFSET_BASIS = 14695981039346656037ull;
+
+// アーカイブをmmapして索引を検査する(中身はコピーしない)
+bool load_asset_archive(AssetArchive& archive, const std::string& path);
+
+// 画像を読む(どこにも無ければNULL)
+// アーカイブに入っていればmmapしたメモリから読むのでファイルを開かない
+SDL_Surface* load_image(const ImageSources& sources, const char* image_path);
+
+// --bakeで作ったディレクトリのindex.txtを読む(1行に画像パスとベイク済みファイル名をタブ区切りで書く)
+bool load_baked_assets(BakedAssets& baked, const std::string& dir);
+
+// 後ろから見ていき、各位置以降で最初のimage命令の位置を求めておく
+void index_next_images(TextureCache& cache, const Program& program);
+
+// プログラムが変わったときに、シーンの解析をやり直して今のシーンを忘れる
+void index_scenes(TextureCache& cache, const Program& program);
+
+// オンデマンド読み込みを有効にし、先読みスレッドを立ち上げる
+void init_texture_cache(TextureCache& cache, const Program& program, const ImageSources& sources, std::size_t budget_mb, int scene_depth);
+
+// 先読みスレッドを止め、キャッシュ中のテクスチャを全て解放する
+void destroy_texture_cache(TextureCache& cache, EngineState& state);
+
+// キャッシュに無い画像をその場で読み込む(先読みが間に合わなかった場合)
+const TextureRegion& fetch_texture(SDL_Renderer* renderer, EngineState& state, const Program& program, std::uint32_t path_index);
+
+// 毎フレーム呼び、先読みの結果をテクスチャにしてから実行位置の先にある画像の先読みを依頼する
+void update_texture_cache(SDL_Renderer* renderer, EngineState& state, const Program& program);
+
+// 読み込んだ画像をテクスチャにする
+// 小さな画像はアトラスにまとめ、描画時に同じテクスチャを使う画像をまとめて送れるようにする
+// surfacesの添字は文字列プールのインデックスで、NULLの要素は飛ばす。surfacesは解放する
+void upload_textures(SDL_Renderer* renderer, EngineState& state, std::vector<SDL_Surface*>& surfaces);
+
+// スクリプト中のimageコマンドが参照する画像パス(文字列プールのインデックス)を重複なく集める
+std::vector<std::uint32_t> collect_image_paths(const Program& program);
+
+// 画像ファイルのデコードをワーカースレッドで並列に行うローダ
+// テクスチャはレンダラのスレッドでしか作れないので、ここではSDL_Surfaceまで作る
+struct ImageLoader {
+  const Program* program;
+  const ImageSources* sources;
+  std::vector<std::uint32_t> paths;    // デコードする画像パス
+  std::vector<SDL_Surface*>* surfaces; // 文字列プールのインデックスを添字とした結果
+  std::vector<char> missing;           // pathsの各画像が見つからなかったかどうか
+  std::atomic<std::size_t> next{0};    // 次にワーカーが取る画像の番号
+  std::atomic<std::size_t> done{0};    // デコードし終えた画像の数
+  std::vector<std::thread> workers;
+};
+
+// スクリプト中の画像のデコードを始める
+void start_image_loader(ImageLoader& loader, const Program& program, const ImageSources& sources,
+                        std::vector<SDL_Surface*>& surfaces, unsigned threads);
+
+// デコードの進み具合(0〜1)
+float image_loader_progress(const ImageLoader& loader);
+
+bool image_loader_finished(const ImageLoader& loader);
+
+// ワーカースレッドの終了を待ち、見つからなかった画像を報告する
+void finish_image_loader(ImageLoader& loader);
+
+// スクリプト中の画像をdirにベイクし、画像パスとの対応をindex.txtに書く
+// prescaleがtrueなら、いつも同じ大きさで表示する画像はその大きさにしておく
+// 既に同じハッシュのファイルがあればデコードしない
+bool bake_assets(const Program& program, const std::string& dir, bool prescale);
+
+// スクリプト中の画像を1つのアーカイブにまとめる
+// bakedにある画像はベイク済みのものを、無ければ元の画像ファイルをそのまま入れる
+bool pack_assets(const Program& program, const BakedAssets& baked, const std::string& path);
+
+// テクスチャの計測値を今の状態に合わせる(事前読み込みの分は読み込んだときに足してある)
+void update_texture_metrics(const Assets& assets);
+
+#endif // ASSETS_H
@@ -0,0 +1,233 @@
+#include "bench.h"                    // マイクロベンチマーク
+#include "script.h"                   // スクリプトの解釈とコンパイル
+#include "vm.h"                       // コマンドとスクリプトの実行
+#include "assets.h"                   // 画像の読み込みとテクスチャの管理
+#include "render.h"                   // 画像と文字列の描画
+#include "profiler.h"                 // フレーム時間とプロファイラ
+#include "actors.h"                   // アクターとスレッドプール
+
+// ---- マイクロベンチマーク(./main --bench で実行) ----
+
+// 従来の実行方式: std::mapとstd::functionで引き、引数を値渡しでコピーする
+using LegacyCommandFn = std::function<int(SDL_Renderer*, std::map<std::string, SDL_Texture*>&, std::map<std::string, ImageState>&, std::vector<Parameter>)>;
+
+int legacy_command_nop(SDL_Renderer* renderer, std::map<std::string, SDL_Texture*>& textures, std::map<std::string, ImageState>& draw_images, std::vector<Parameter> params) {
+  return 0;
+}
+
+// 従来のcommand_imageと同じく毎回文字列を引いてstd::stoiで解釈する
+int legacy_command_image(SDL_Renderer* renderer, std::map<std::string, SDL_Texture*>& textures, std::map<std::string, ImageState>& draw_images, std::vector<Parameter> params) {
+  std::string id = std::get<1>(params[0]);
+  std::string img_path = std::get<1>(params[1]);
+
+  if (textures.find(img_path) == textures.end()) return 1;
+
+  SDL_Rect rect;
+  rect.x = std::stoi(std::get<1>(params[2]));
+  rect.y = std::stoi(std::get<1>(params[3]));
+  rect.w = std::stoi(std::get<1>(params[4]));
+  rect.h = std::stoi(std::get<1>(params[5]));
+
+  // 従来は1枚の画像が1枚のテクスチャだったので、テクスチャ全体を指す領域にする
+  draw_images[id] = ImageState{TextureRegion{textures.at(img_path), SDL_Rect{0, 0, rect.w, rect.h}, 0.0f, 0.0f, 1.0f, 1.0f}, rect};
+  return 0;
+}
+
+// ベンチマーク用のスクリプトを生成する
+std::string make_bench_script(int lines) {
+  std::stringstream ss;
+  for (int i = 0; i < lines; i++) {
+    switch (i % 4) {
+    case 0: ss << "label\tL" << i << "\n"; break;
+    case 1: ss << "goto\tL" << i - 1 << "\n"; break;
+    default:
+      ss << "image\tsprite" << i % 16 << "\t\"bench.png\"\t" << i % 800 << "\t" << i % 600 << "\t32\t32\n";
+      break;
+    }
+  }
+  return ss.str();
+}
+
+// 実際のスクリプトを画面なしで実行し、解釈速度・実行速度・フレーム時間を測る
+// 画像は読み込まず、全てのimageコマンドに同じ仮のテクスチャを使う
+// replayがNULLでなければ、キー入力をそこから再生して記録したロジック更新の回数だけ実行する
+int bench_script(SDL_Renderer* renderer, SDL_Texture* tex, const std::string& path, std::uint64_t budget_us,
+                 const InputLog* replay) {
+  std::optional<std::string> source = load_txt(path);
+  if (!source || source->empty()) {
+    std::cerr << "bench: " << path << " could not be read." << std::endl;
+    return 1;
+  }
+  std::cout << "[" << path << "]" << std::endl;
+
+  // 解釈とコンパイル(時間が短すぎないよう、合わせてBENCH_PARSE_BYTESほど読む)
+  std::size_t parse_passes = std::max<std::size_t>(1, BENCH_PARSE_BYTES / source->size());
+  std::size_t sink = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (std::size_t pass = 0; pass < parse_passes; pass++) sink += compile_source(*source).code.size();
+  double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  std::cout << "parse: " << static_cast<double>(source->size()) * parse_passes / (1024.0 * 1024.0) / sec << " MB/s" << std::endl;
+  if (sink == 0) std::cerr << "bench: empty program" << std::endl;
+
+  Program program = compile_source(*source);
+  Assets assets{};
+  EngineState state{};
+  state.assets = &assets;
+  state.assets->textures.assign(program.strings.size(), TextureRegion{});
+  for (std::uint32_t path_index : collect_image_paths(program)) {
+    state.assets->textures[path_index] = make_region(tex, SDL_Rect{0, 0, 32, 32}, 32, 32);
+  }
+  state.variables.assign(program.symbols.size(), 0.0);
+  state.executed_frames.assign(program.code.size(), 0);
+  // 記録したときと同じく、時間でなく命令数で実行を打ち切る
+  if (replay) state.instruction_budget = REPLAY_STEP_INSTRUCTIONS;
+  init_sprites(state.sprites, program.symbols.size());
+  init_texts(state.texts, program.strings.size());
+  state.assets->glyph_atlas.layouts.assign(program.strings.size(), TextLayout{});
+  state.assets->glyph_atlas.font_warned = true; // フォントは読み込まないので知らせない
+
+  // キー入力は何も押されていない状態のまま(再生するときは記録どおりに)、1フレームずつ実行して描画する
+  // 再生するときは記録したときのロジック更新1回を1フレームとして、待たずに実行する
+  InputPlayer player{replay, 0, 0, 0};
+  const int frames = replay ? static_cast<int>(replay->header.steps) : BENCH_FRAMES;
+  Profiler profiler{};
+  ActorPool actors;
+  init_actor_pool(actors, program, 0);
+  SpriteBatch batch;
+  RenderQueue queue;
+  FrameStats frame_stats{};
+  const Uint64 frequency = SDL_GetPerformanceFrequency();
+  Uint64 vm_ticks = 0;
+  std::uint64_t executed = 0;
+  Uint64 run_begin = SDL_GetPerformanceCounter();
+  for (int frame = 0; frame < frames; frame++) {
+    Uint64 frame_begin = SDL_GetPerformanceCounter();
+    if (replay) {
+      replay_input(player, state.input);
+    } else {
+      snapshot_input(state.input);
+    }
+    executed += run_script(renderer, state, program, budget_us, profiler);
+    step_actors(actors, renderer, state);
+    Uint64 vm_end = SDL_GetPerformanceCounter();
+    vm_ticks += vm_end - frame_begin;
+
+    SDL_RenderClear(renderer);
+    render_images(renderer, state.sprites, queue, batch);
+    render_texts(renderer, state.texts, state.assets->glyph_atlas, batch);
+    SDL_RenderPresent(renderer);
+    record_frame_time(frame_stats, (SDL_GetPerformanceCounter() - frame_begin) * 1000.0 / frequency);
+  }
+  double vm_sec = static_cast<double>(vm_ticks) / frequency;
+  std::cout << "run: " << static_cast<long long>(vm_sec > 0.0 ? executed / vm_sec : 0.0) << " commands/sec ("
+            << executed << " commands in " << frames << " frames)" << std::endl;
+  std::cout << "frame ms: p50 " << stats_percentile(frame_stats, 50) << " p95 " << stats_percentile(frame_stats, 95)
+            << " p99 " << stats_percentile(frame_stats, 99) << " max " << stats_percentile(frame_stats, 100) << std::endl;
+  std::cout << "draw: " << queue.visible << " visible, " << queue.culled << " culled, "
+            << queue.batch_tex.size() << " draw calls (last frame)" << std::endl;
+  if (!actors.actors.empty()) std::cout << "actors: " << actors.actors.size() << std::endl;
+  if (replay) {
+    double run_sec = static_cast<double>(SDL_GetPerformanceCounter() - run_begin) / frequency;
+    std::cout << "replay: " << replay->header.duration_us / 1e6 << " s recorded, replayed in " << run_sec << " s, state "
+              << std::hex << state_digest(state) << std::dec << std::endl;
+  }
+  destroy_actor_pool(actors);
+  return 0;
+}
+
+int run_bench(const std::vector<std::string>& scripts, std::uint64_t budget_us, const InputLog* replay) {
+  const int script_lines = 10000;
+  const int passes = 200;
+  const std::string source = make_bench_script(script_lines);
+  std::vector<Command> commands = parse(source);
+  Program program = compile(commands);
+
+  // スクリプトの解釈速度(従来のコマンド列を経由する方式と1回の走査で変換する方式)
+  {
+    const int parse_passes = 20;
+    auto report_parse = [&](const char* name, std::chrono::steady_clock::duration elapsed) {
+      double sec = std::chrono::duration<double>(elapsed).count();
+      double mb = static_cast<double>(source.size()) * parse_passes / (1024.0 * 1024.0);
+      std::cout << name << ": " << mb / sec << " MB/s" << std::endl;
+    };
+    std::size_t sink = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int pass = 0; pass < parse_passes; pass++) sink += compile(parse(source)).code.size();
+    report_parse("parse+compile", std::chrono::steady_clock::now() - start);
+    start = std::chrono::steady_clock::now();
+    for (int pass = 0; pass < parse_passes; pass++) sink += compile_source(source).code.size();
+    report_parse("compile_source", std::chrono::steady_clock::now() - start);
+    if (sink == 0) std::cerr << "bench: empty program" << std::endl;
+  }
+
+  // 画面を持たないソフトウェアレンダラで計測する
+  SDL_Surface* surface = SDL_CreateRGBSurfaceWithFormat(0, SCREEN_WIDTH, SCREEN_HEIGHT, 32, SDL_PIXELFORMAT_ARGB8888);
+  SDL_Renderer* renderer = SDL_CreateSoftwareRenderer(surface);
+  SDL_Texture* tex = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STATIC, 32, 32);
+
+  auto report = [&](const char* name, std::chrono::steady_clock::duration elapsed) {
+    double sec = std::chrono::duration<double>(elapsed).count();
+    double count = static_cast<double>(commands.size()) * passes;
+    std::cout << name << ": " << static_cast<long long>(count / sec) << " commands/sec" << std::endl;
+  };
+
+  // 従来方式
+  {
+    std::map<CommandName, LegacyCommandFn> fn_map;
+    for (int i = 0; i < COMMAND_COUNT; i++) fn_map[static_cast<CommandName>(i)] = legacy_command_nop;
+    fn_map[IMAGE] = legacy_command_image;
+    std::map<std::string, SDL_Texture*> textures{{"bench.png", tex}};
+    std::map<std::string, ImageState> draw_images;
+
+    auto start = std::chrono::steady_clock::now();
+    for (int pass = 0; pass < passes; pass++) {
+      for (std::size_t command_index = 0; command_index < commands.size(); command_index++) {
+        CommandName command_name;
+        std::vector<Parameter> params;
+        std::tie(command_name, params) = commands[command_index];
+        fn_map[command_name](renderer, textures, draw_images, params);
+      }
+    }
+    report("std::map + std::function", std::chrono::steady_clock::now() - start);
+  }
+
+  // 関数表方式
+  {
+    Assets assets{};
+    EngineState state{};
+    state.assets = &assets;
+    state.assets->textures.assign(program.strings.size(), make_region(tex, SDL_Rect{0, 0, 32, 32}, 32, 32));
+    state.variables.assign(program.symbols.size(), 0.0);
+    init_sprites(state.sprites, program.symbols.size());
+
+    auto start = std::chrono::steady_clock::now();
+    for (int pass = 0; pass < passes; pass++) {
+      for (std::size_t i = 0; i < program.code.size(); i++) {
+        state.command_index = i + 1;
+        execute(renderer, state, program, program.code[i]);
+      }
+    }
+    report("bytecode + jump table", std::chrono::steady_clock::now() - start);
+  }
+
+  int result = 0;
+  for (const auto& path : scripts) {
+    if (bench_script(renderer, tex, path, budget_us, replay) != 0) result = 1;
+  }
+
+  SDL_DestroyTexture(tex);
+  SDL_DestroyRenderer(renderer);
+  SDL_FreeSurface(surface);
+  return result;
+}
+
+int run_replay(const std::string& path, const InputLog& replay, std::uint64_t budget_us) {
+  SDL_Surface* surface = SDL_CreateRGBSurfaceWithFormat(0, SCREEN_WIDTH, SCREEN_HEIGHT, 32, SDL_PIXELFORMAT_ARGB8888);
+  SDL_Renderer* renderer = SDL_CreateSoftwareRenderer(surface);
+  SDL_Texture* tex = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STATIC, 32, 32);
+  int result = bench_script(renderer, tex, path, budget_us, &replay);
+  SDL_DestroyTexture(tex);
+  SDL_DestroyRenderer(renderer);
+  SDL_FreeSurface(surface);
+  return result;
+}
@@ -0,0 +1,16 @@
+// マイクロベンチマーク
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "engine.h"                   // エンジン全体で使う型と定数
+#include "input.h"                    // キー入力と入力ログ
+
+// 従来方式と関数表方式で毎秒何コマンド実行できるかを比較し、scriptsのスクリプトも計測する
+// 画面は開かないので、ウィンドウの無いCIでも実行できる
+// replayがNULLでなければ、scriptsのスクリプトはそのキー入力を再生して実行する
+int run_bench(const std::vector<std::string>& scripts, std::uint64_t budget_us, const InputLog* replay);
+
+// 記録したキー入力でスクリプトを画面なしで再生する(待たずに、できるだけ速く実行する)
+int run_replay(const std::string& path, const InputLog& replay, std::uint64_t budget_us);
+
+#endif // BENCH_H
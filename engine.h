@@ -0,0 +1,521 @@
+// エンジン全体で使う型と定数
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include <SDL2/SDL.h>                 // SDL2
+#include <SDL2/SDL_image.h>           // SDL2_image
+#include <SDL2/SDL_ttf.h>             // SDL2_ttf
+#include <string>                     // 文字列を扱う
+#include <vector>                     // 可変長配列
+#include <iostream>                   // 標準出力と標準エラー出力
+#include <tuple>                      // std::pairを使いたい
+#include <utility>                    // pairから値を取得するstd::getを使いたい
+#include <fstream>                    // ファイルを扱う
+#include <sstream>                    // ファイルを文字列ストリームとして扱う
+#include <optional>                   // 値が無い状態を扱えるstd::optionalを使いたい
+#include <map>                        // 連想配列を使いたい
+#include <cstdint>                    // 固定幅の整数型を使いたい
+#include <functional>                 // 関数オブジェクトを使いたい
+#include <array>                      // 固定長配列を使いたい
+#include <chrono>                     // 時間を計測したい
+#include <cstring>                    // コマンドライン引数の比較に使いたい
+#include <cstdio>                     // ベイク済み画像のファイル名を作りたい
+#include <algorithm>                  // 統計を取るためにソートしたい
+#include <thread>                     // 画像のデコードを並列に行いたい
+#include <atomic>                     // スレッド間で進捗を共有したい
+#include <mutex>                      // 先読みの依頼と結果をスレッド間で受け渡したい
+#include <condition_variable>         // 先読みの依頼が来るまでスレッドを眠らせたい
+#include <cmath>                      // 式の剰余を求めたい
+#include <bitset>                     // キーの状態をビット列で持ちたい
+#include <string_view>                // 文字列プールやスクリプトをコピーせずに参照したい
+#include <charconv>                   // 例外を使わずに数値を解釈したい
+#include <memory>                     // コンパイル済みスクリプトのメモリの持ち主を共有したい
+#include <unordered_map>              // テクスチャごとに描画をまとめたい
+#include <deque>                      // スレッドごとの仕事のキューを両端から取りたい
+
+// 区間の計測(ENGINE_TRACYを定義してビルドしたときだけTracyのゾーンになり、それ以外は何も残らない)
+#ifdef ENGINE_TRACY
+#include <tracy/Tracy.hpp>
+#include <tracy/TracyC.h>
+#define ENGINE_ZONE(name) ZoneScopedN(name)
+#define ENGINE_FRAME_MARK() FrameMark
+#else
+#define ENGINE_ZONE(name)
+#define ENGINE_FRAME_MARK()
+#endif
+
+// ウィンドウサイズ
+const int SCREEN_WIDTH = 800;
+const int SCREEN_HEIGHT = 600;
+
+// 1フレームでスクリプトの実行に使ってよい時間(マイクロ秒)の既定値
+const std::uint64_t DEFAULT_SCRIPT_BUDGET_US = 2000;
+// サブルーチン呼び出しを入れ子にできる深さ
+const std::uint32_t CALL_STACK_SIZE = 256;
+// 式を評価するときのスタックの深さの上限
+const std::uint32_t EXPR_STACK_SIZE = 32;
+// 経過時間を確かめる間隔(命令数)
+const std::uint32_t BUDGET_CHECK_INTERVAL = 64;
+// 入力ログを記録・再生するときに1回のロジック更新で実行する命令数の上限
+// (時間で打ち切ると機械の速さで実行する命令数が変わり、再生しても同じ状態にならない)
+const std::uint32_t REPLAY_STEP_INSTRUCTIONS = 100000;
+
+// ロジック更新の頻度(Hz)の既定値
+const double DEFAULT_LOGIC_HZ = 60.0;
+// 処理が遅れたときに1フレームで追いつくロジック更新の最大回数
+const int MAX_LOGIC_STEPS_PER_FRAME = 4;
+// フレーム時間の統計を取る直近のフレーム数
+const std::size_t FRAME_STATS_WINDOW = 240;
+
+// アトラスにまとめる画像の辺の長さの上限(これより大きい画像は単独のテクスチャにする)
+const int ATLAS_MAX_IMAGE_SIZE = 512;
+// アトラス1枚の辺の長さ(レンダラの上限の方が小さければそちらに合わせる)
+const int ATLAS_PAGE_SIZE = 2048;
+// アトラス内で隣り合う画像同士の間隔(フィルタリングで隣の画像がにじまないように)
+const int ATLAS_PADDING = 1;
+// ベイク済み画像の画素の形式(多くのレンダラがそのままテクスチャにできる形式)
+const Uint32 BAKED_PIXEL_FORMAT = SDL_PIXELFORMAT_ARGB8888;
+
+// オンデマンド読み込み時のテクスチャの合計サイズ(MB)の上限の既定値
+const std::size_t DEFAULT_TEXTURE_BUDGET_MB = 256;
+// 実行位置から先読みするimageコマンドの数
+const int TEXTURE_PREFETCH_COUNT = 8;
+// 1フレームでテクスチャにする先読み済み画像の最大数
+const int TEXTURE_UPLOADS_PER_FRAME = 4;
+// 今のシーン(ラベルで区切った範囲)から何回の移動で辿り着くシーンまでの画像を先読みするかの既定値
+const int DEFAULT_SCENE_DEPTH = 2;
+
+// textコマンドで使うフォントの既定のパスと大きさ
+const char* const DEFAULT_FONT_PATH = "font.ttf";
+const int FONT_SIZE = 24;
+// 文字を描き込んでおくグリフアトラスの辺の長さ
+const int GLYPH_ATLAS_SIZE = 1024;
+
+// 画像の重なりを調べる格子の1マスの辺の長さ
+const int RENDER_GRID_CELL = 64;
+
+// アクター1つが1回のロジック更新でスクリプトの実行に使う時間(マイクロ秒)
+const std::uint64_t ACTOR_SCRIPT_BUDGET_US = 200;
+// 入力ログを記録・再生するときにアクター1つが1回のロジック更新で実行する命令数の上限
+const std::uint32_t REPLAY_ACTOR_STEP_INSTRUCTIONS = 10000;
+// アクターの最大数
+const std::size_t MAX_ACTORS = 4096;
+// スレッドプールに1回で渡すアクターの数
+const std::uint32_t ACTOR_CHUNK_SIZE = 16;
+
+// ベンチマークで実際のスクリプトを実行するフレーム数
+const int BENCH_FRAMES = 600;
+// ベンチマークでスクリプトの解釈速度を測るときに読む合計の大きさ(バイト)
+const std::size_t BENCH_PARSE_BYTES = 16 * 1024 * 1024;
+
+// 計測値を書き出す間隔(ミリ秒)の既定値
+const Uint32 METRICS_INTERVAL_MS = 1000;
+
+// ホットリロードでスクリプトの更新を確かめる間隔(ミリ秒)
+const Uint32 SCRIPT_WATCH_INTERVAL_MS = 250;
+
+// コマンド名を数値にマッピングした型
+enum CommandName {
+  LABEL,
+  IMAGE,
+  CLEAR,
+  TEXT,
+  GOTO,
+  SET,
+  INPUT,
+  IF,
+  RETURN,
+  WAIT,
+  SPAWN,
+  COMMAND_COUNT, // 組み込みコマンドの種類数
+  MAX_COMMANDS = 64, // register_commandで追加するコマンドも含めた種類数の上限(関数表の大きさに使う)
+};
+
+// コマンド名でCommandNameを引ける辞書として(std::string_viewのままで引ける)
+// register_commandで追加したコマンドもここに入る
+extern std::map<std::string, CommandName, std::less<>> COMMAND_MAP;
+
+// テクスチャ(アトラス)の中で1枚の画像が占める領域
+struct TextureRegion {
+  SDL_Texture* tex;
+  SDL_Rect src;
+  float u0, v0, u1, v1; // srcをテクスチャ座標(0〜1)に直したもの
+};
+
+struct ImageState {
+  TextureRegion region;
+  SDL_Rect rect;
+};
+
+// 表示中の画像をまとめた構造体配列(SoA)
+// 画像のid(シンボルプールのインデックス)から密な配列上のスロットを引く
+// 描画はz順(同じzなら最初に表示した順)に並べたスロット列をたどり、並べ直すのは順序が変わったときだけ
+struct SpriteStore {
+  std::vector<std::int32_t> slot_of;     // id→スロット(-1なら表示していない)
+  std::vector<std::uint32_t> ids;        // スロット→id
+  std::vector<TextureRegion> regions;
+  std::vector<SDL_Rect> rects;
+  std::vector<std::int32_t> z;
+  std::vector<std::uint32_t> draw_order; // z順に並べたスロット
+  bool order_dirty;
+  bool changed;                          // 前回描画してから見た目が変わったか
+};
+
+
+using TypeName = std::string;
+using Value = std::string;
+using Parameter = std::pair<TypeName, Value>;
+using Command = std::pair<CommandName, std::vector<Parameter>>;
+
+// バイトコードのオペランドの種類
+enum OperandKind : std::uint8_t {
+  OPERAND_NUMBER, // 数値の即値
+  OPERAND_STRING, // 文字列プールのインデックス
+  OPERAND_SYMBOL, // シンボルプールのインデックス
+  OPERAND_LABEL,  // 飛び先の命令のインデックス(ラベルはコンパイル時に解決する)
+  OPERAND_EXPR,   // コンパイル済みの式のインデックス
+};
+
+// コンパイル済みの式の命令(後置記法でスタックを使って評価する)
+enum ExprOp : std::uint8_t {
+  EXPR_CONST, // 定数を積む
+  EXPR_LOAD,  // 変数の値を積む
+  EXPR_NEG,
+  EXPR_ADD,
+  EXPR_SUB,
+  EXPR_MUL,
+  EXPR_DIV,
+  EXPR_MOD,
+  EXPR_LT,
+  EXPR_GT,
+  EXPR_LE,
+  EXPR_GE,
+  EXPR_EQ,
+  EXPR_NE,
+  EXPR_AND,
+  EXPR_OR,
+};
+
+struct ExprInstr {
+  ExprOp op;
+  std::uint32_t slot; // EXPR_LOADで読む変数(シンボルプールのインデックス)
+  double value;       // EXPR_CONSTで積む値
+};
+
+// 式1つ分の命令はProgram::expr_codeの[begin, begin + count)に並ぶ
+struct Expression {
+  std::uint32_t begin;
+  std::uint32_t count;
+};
+
+// バイトコードのオペランド
+// 数値は解釈済みの値を、文字列とシンボルはプール内のインデックスを持つ
+struct Operand {
+  OperandKind kind;
+  std::uint32_t index;
+  double number;
+};
+
+// バイトコードの1命令
+// オペランドはProgram::operandsの[operand_begin, operand_begin + operand_count)に並ぶ
+struct Instruction {
+  CommandName op;
+  std::uint32_t operand_begin;
+  std::uint32_t operand_count;
+};
+
+// コンパイル中のスクリプト(完成したらfinalize_programでProgramにする)
+struct ProgramData {
+  std::vector<Instruction> code;
+  std::vector<Operand> operands;
+  std::vector<std::string> strings; // 文字列リテラルのプール
+  std::vector<std::string> symbols; // シンボルのプール
+  std::vector<std::int32_t> labels; // シンボル→ラベルの命令のインデックス(ラベルでなければ-1)
+  std::vector<ExprInstr> expr_code;  // setとifの式をコンパイルした命令列
+  std::vector<Expression> expressions;
+};
+
+// 連続したメモリ上の配列を所有せずに参照するビュー
+template <typename T>
+struct ArrayView {
+  const T* ptr;
+  std::size_t count;
+
+  const T& operator[](std::size_t i) const { return ptr[i]; }
+  const T* data() const { return ptr; }
+  std::size_t size() const { return count; }
+  bool empty() const { return count == 0; }
+  const T* begin() const { return ptr; }
+  const T* end() const { return ptr + count; }
+};
+
+// NUL終端した文字列を詰めて並べた文字列プールのビュー
+struct StringTable {
+  ArrayView<std::uint32_t> offsets; // 各文字列の先頭位置(文字列の数+1個。最後は全体の長さ)
+  const char* chars;
+
+  std::size_t size() const { return offsets.empty() ? 0 : offsets.size() - 1; }
+  std::string_view operator[](std::size_t i) const {
+    return std::string_view(chars + offsets[i], offsets[i + 1] - offsets[i] - 1);
+  }
+  const char* c_str(std::size_t i) const { return chars + offsets[i]; }
+};
+
+// 1つの領域の先頭から順に切り出していくバンプアロケータ
+// baseがNULLの間は切り出さずに必要な大きさ(used)だけを数える
+struct Arena {
+  unsigned char* base;
+  std::size_t capacity;
+  std::size_t used;
+};
+
+inline std::size_t align_up(std::size_t n, std::size_t alignment) {
+  return (n + alignment - 1) / alignment * alignment;
+}
+
+// count個のTを切り出す(中身は初期化しない。Tはmemcpyで扱える型に限る)
+template <typename T>
+T* arena_alloc(Arena& arena, std::size_t count) {
+  std::size_t begin = align_up(arena.used, alignof(T));
+  arena.used = begin + sizeof(T) * count;
+  return arena.base == NULL ? NULL : reinterpret_cast<T*>(arena.base + begin);
+}
+
+// 1フレームの間だけ使う一時領域(フレームの始めにreset_scratchで空にする)
+// 足りなければ別に確保してしのぎ、次のresetでそれまでの最大に合わせて広げる
+struct ScratchArena {
+  Arena arena;
+  std::unique_ptr<unsigned char[]> buffer;
+  std::vector<std::unique_ptr<unsigned char[]>> overflow;
+  std::size_t peak;
+};
+
+template <typename T>
+T* scratch_alloc(ScratchArena& scratch, std::size_t count) {
+  Arena& arena = scratch.arena;
+  std::size_t before = arena.used;
+  T* ptr = arena_alloc<T>(arena, count);
+  scratch.peak = std::max(scratch.peak, arena.used);
+  if (arena.used <= arena.capacity) return ptr;
+  arena.used = before;
+  scratch.overflow.emplace_back(new unsigned char[sizeof(T) * count + alignof(T)]);
+  scratch.peak += sizeof(T) * count + alignof(T);
+  return reinterpret_cast<T*>(align_up(reinterpret_cast<std::uintptr_t>(scratch.overflow.back().get()), alignof(T)));
+}
+
+inline void reset_scratch(ScratchArena& scratch) {
+  if (scratch.peak > scratch.arena.capacity) {
+    std::size_t capacity = align_up(scratch.peak, 4096);
+    scratch.buffer.reset(new unsigned char[capacity]);
+    scratch.arena.base = scratch.buffer.get();
+    scratch.arena.capacity = capacity;
+  }
+  scratch.overflow.clear();
+  scratch.arena.used = 0;
+  scratch.peak = 0;
+}
+
+// 実行するコンパイル済みのスクリプト(中身はProgramDataと同じ)
+// 各配列はstorageが持つ1つの連続したメモリ(コンパイル結果か、mmapしたコンパイル済みファイル)を指す
+struct Program {
+  ArrayView<Instruction> code;
+  ArrayView<Operand> operands;
+  StringTable strings;
+  StringTable symbols;
+  ArrayView<std::int32_t> labels;
+  ArrayView<ExprInstr> expr_code;
+  ArrayView<Expression> expressions;
+  std::shared_ptr<const void> storage;
+};
+
+// グリフアトラス上の1文字
+struct GlyphInfo {
+  TextureRegion region;
+  int advance; // 次の文字までの横幅
+};
+
+// 文字列を並べた結果(文字列の左上を原点とした各文字の位置)
+struct TextLayout {
+  std::vector<TextureRegion> regions;
+  std::vector<SDL_Rect> rects;
+};
+
+// 文字を一度だけラスタライズして描き溜めておくテクスチャと、文字列ごとのレイアウト
+struct GlyphAtlas {
+  TTF_Font* font;
+  SDL_Texture* tex;
+  int shelf_x, shelf_y, shelf_h;          // 次の文字を置く位置(棚詰め)
+  std::map<std::uint32_t, GlyphInfo> glyphs; // コードポイント→文字
+  std::vector<TextLayout> layouts;        // 文字列プールのインデックス→レイアウト
+  bool font_warned;                       // フォントが無くtextコマンドが何も表示しないことを知らせたか
+};
+
+// 表示中の文字列(添字は文字列プールのインデックス。同じ文字列は1か所にだけ表示する)
+struct TextStore {
+  std::vector<std::int32_t> slot_of;     // 文字列→スロット(-1なら表示していない)
+  std::vector<std::uint32_t> strings;    // スロット→文字列
+  std::vector<SDL_Point> positions;
+};
+
+// ロジック更新ごとに取るキー入力のスナップショット
+using KeyState = std::bitset<SDL_NUM_SCANCODES>;
+struct InputState {
+  KeyState current;  // 押されているキー
+  KeyState previous; // 前回のロジック更新で押されていたキー
+};
+
+// 先読みする画像をデコードするスレッドとのやりとり
+struct TexturePrefetcher {
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::vector<std::uint32_t> queue;                             // デコードを依頼された画像パス
+  std::vector<std::pair<std::uint32_t, SDL_Surface*>> decoded;  // デコードし終えた画像
+  bool stopping = false;
+  std::thread worker;
+};
+
+// スクリプトをラベルで区切ったシーンと、各シーンから決まった回数の移動以内に辿り着くシーンで使う画像
+// シーン間の移動はgoto・if・input・spawnの飛び先と、次のシーンへの素通り
+struct SceneGraph {
+  std::vector<std::uint32_t> starts;      // シーン→先頭の命令(昇順)
+  std::vector<std::uint32_t> asset_begin; // シーン→assetsでの始まり(最後に全体の数)
+  std::vector<std::uint32_t> assets;      // 辿り着くシーンの画像パス(近いシーンのものから)
+};
+
+// 画像を使うときに読み込み、合計サイズが上限を超えたら長く使われていないものから捨てるキャッシュ
+// 添字はどれも文字列プールのインデックス
+struct TextureCache {
+  bool enabled;
+  std::size_t budget_bytes;
+  std::size_t resident_bytes;
+  std::uint64_t clock;                   // テクスチャが使われるたびに進める時計
+  std::vector<std::uint64_t> last_used;  // 最後に使われた時刻
+  std::vector<std::size_t> bytes;        // 常駐しているテクスチャの推定サイズ
+  std::vector<std::uint32_t> resident;   // 常駐している画像パスの一覧
+  std::vector<char> requested;           // 先読みを依頼済みか
+  std::vector<char> missing;             // ファイルが見つからなかったか(二度と読みに行かない)
+  std::vector<std::uint32_t> next_image; // 命令ごとに、その位置以降で最初のimage命令の位置
+  SceneGraph scenes;
+  int scene_depth;                       // 何回の移動で辿り着くシーンまで先読みするか
+  std::uint32_t current_scene;           // 前のフレームで実行していたシーン
+  std::vector<char> reachable;           // 今のシーンから辿り着くシーンで使う画像か
+  std::uint64_t hits, misses;
+  TexturePrefetcher prefetcher;
+  ScratchArena scratch;                  // 1フレームの間だけ使う一時領域(メインスレッドだけが使う)
+};
+
+// ベイク済み画像の一覧(--bakeで作ったディレクトリのindex.txtを読んだもの)
+struct BakedAssets {
+  std::map<std::string, std::string, std::less<>> files; // 画像パス→ベイク済みファイルのパス
+};
+
+// ---- 画像をまとめたアーカイブ ----
+// 画像ファイルを1つのファイルにまとめ、実行時は1回だけmmapして画像パスのハッシュで引く
+// ヘッダ、ハッシュ順に並べた索引、画像パスの文字、各画像の中身の順に並べる(中身は8バイト境界)
+
+const char ASSET_ARCHIVE_MAGIC[4] = {'E', 'G', 'E', 'A'};
+const std::uint32_t ASSET_ARCHIVE_VERSION = 1;
+
+// アーカイブに入れた画像の中身の種類
+enum ArchiveEntryKind : std::uint32_t {
+  ARCHIVE_ENCODED, // 元の画像ファイル(PNGなど。読むときにデコードする)
+  ARCHIVE_BAKED,   // ベイク済み画像
+};
+
+struct AssetArchiveHeader {
+  char magic[4];
+  std::uint32_t version;
+  std::uint32_t byte_order;
+  std::uint32_t entry_count;
+};
+
+struct AssetArchiveEntry {
+  std::uint64_t path_hash;
+  std::uint64_t offset;      // 中身のファイル先頭からの位置
+  std::uint64_t size;
+  std::uint32_t path_offset; // 画像パスのファイル先頭からの位置
+  std::uint32_t path_size;
+  std::uint32_t kind;        // ArchiveEntryKind
+  std::uint32_t reserved;
+};
+
+// mmapしたアーカイブ(entriesがNULLなら使わない)
+struct AssetArchive {
+  std::shared_ptr<const void> storage;
+  const char* base;
+  std::size_t size;
+  const AssetArchiveEntry* entries;
+  std::uint32_t entry_count;
+};
+
+// 画像を読む場所の一覧(アーカイブ、ベイク済み画像、元の画像ファイルの順に探す)
+struct ImageSources {
+  AssetArchive archive;
+  BakedAssets baked;
+};
+
+// 全てのスクリプト実行(メインのスクリプトとアクター)で共有する画像と文字
+struct Assets {
+  // 画像を読む場所
+  ImageSources sources;
+  // 文字列プールのインデックスで引ける画像の領域(画像パス以外はtexがNULL)
+  std::vector<TextureRegion> textures;
+  // 実際に作ったテクスチャ(アトラスと単独の画像)。終了時に解放する
+  std::vector<SDL_Texture*> texture_pages;
+  // 文字列の描画に使うグリフアトラス
+  GlyphAtlas glyph_atlas;
+  // オンデマンド読み込みのテクスチャキャッシュ(enabledがfalseなら全て事前に読み込む)
+  TextureCache texture_cache;
+};
+
+// スクリプト1つ分の実行状態(メインのスクリプトとアクターがそれぞれ持つ)
+struct EngineState {
+  // 共有する画像と文字
+  Assets* assets;
+  // シンボルプールのインデックスをidとした表示中の画像
+  SpriteStore sprites;
+  // 表示中の文字列
+  TextStore texts;
+  // シンボルプールのインデックスで引ける変数
+  std::vector<double> variables;
+
+  // 次に実行する命令のインデックス
+  std::size_t command_index;
+  // 現在のフレーム番号
+  std::uint32_t frame;
+  // 命令ごとに最後に実行したフレーム番号(inputの二度目の実行でフレームを譲るのに使う)
+  std::vector<std::uint32_t> executed_frames;
+  // このロジック更新でのキー入力
+  InputState input;
+  // サブルーチンの戻り先(呼び出しのたびに確保しないよう固定長)
+  std::array<std::uint32_t, CALL_STACK_SIZE> call_stack;
+  std::uint32_t call_depth;
+  // 実行を再開するまでに待つ残りフレーム数
+  std::uint32_t wait_frames;
+  // trueならこのフレームのスクリプト実行を打ち切る
+  bool yield;
+  // 0でなければ予算時間の代わりにこの命令数で1フレームの実行を打ち切る(入力ログの記録と再生で使う)
+  std::uint32_t instruction_budget;
+
+  // 命令→imageコマンドが前回書いたスロット(-1なら未実行。image以外の命令の分は使わない)
+  std::vector<std::int32_t> image_slots;
+
+  // trueなら他のスクリプトと並列に実行中なので、共有のテクスチャキャッシュに触らない
+  bool parallel;
+  // 並列実行中に使った画像パス(後でメインスレッドがキャッシュに知らせる)
+  std::vector<std::uint32_t> texture_requests;
+  // spawnで生み出すアクターの開始位置(このロジック更新の実行が終わってから作る)
+  std::vector<std::uint32_t> spawn_requests;
+};
+
+// 命令のオペランド列を所有せずに参照するビュー
+struct OperandView {
+  const Operand* data;
+  std::uint32_t size;
+
+  const Operand& operator[](std::uint32_t i) const { return data[i]; }
+};
+
+using CommandFn = int (*)(SDL_Renderer*, EngineState&, const Program&, OperandView);
+
+#endif // ENGINE_H
@@ -0,0 +1,131 @@
+#include "input.h"                    // キー入力と入力ログ
+#include "script.h"                   // スクリプトの解釈とコンパイル
+#include "assets.h"                   // 画像の読み込みとテクスチャの管理
+
+void read_keyboard(KeyState& keys) {
+  int count = 0;
+  const Uint8* state = SDL_GetKeyboardState(&count);
+  count = std::min(count, static_cast<int>(SDL_NUM_SCANCODES));
+  for (int i = 0; i < count; i++) keys[i] = state[i] != 0;
+}
+
+void snapshot_input(InputState& input) {
+  input.previous = input.current;
+  read_keyboard(input.current);
+}
+
+bool init_input_recorder(InputRecorder& recorder, const std::string& path, double logic_hz, std::uint64_t program_hash) {
+  recorder.file.open(path, std::ios::binary | std::ios::trunc);
+  if (!recorder.file) return false;
+  recorder.header = InputLogHeader{};
+  std::memcpy(recorder.header.magic, INPUT_LOG_MAGIC, sizeof(recorder.header.magic));
+  recorder.header.version = INPUT_LOG_VERSION;
+  recorder.header.logic_hz = logic_hz;
+  recorder.header.program_hash = program_hash;
+  recorder.file.write(reinterpret_cast<const char*>(&recorder.header), sizeof(recorder.header));
+  recorder.last.reset();
+  recorder.started = SDL_GetPerformanceCounter();
+  recorder.frequency = SDL_GetPerformanceFrequency();
+  return true;
+}
+
+void record_input(InputRecorder& recorder, const KeyState& keys) {
+  if (!recorder.file.is_open()) return;
+  KeyState changed = keys ^ recorder.last;
+  if (changed.any()) {
+    InputLogEntry entry{};
+    entry.time_us = static_cast<std::uint64_t>((SDL_GetPerformanceCounter() - recorder.started) * 1000000.0 / recorder.frequency);
+    entry.step = recorder.header.steps;
+    entry.count = static_cast<std::uint16_t>(changed.count());
+    recorder.file.write(reinterpret_cast<const char*>(&entry), sizeof(entry));
+    for (std::size_t i = 0; i < changed.size(); i++) {
+      if (!changed[i]) continue;
+      std::uint16_t code = static_cast<std::uint16_t>(i);
+      recorder.file.write(reinterpret_cast<const char*>(&code), sizeof(code));
+    }
+    recorder.header.entries++;
+    recorder.last = keys;
+  }
+  recorder.header.steps++;
+}
+
+void close_input_recorder(InputRecorder& recorder) {
+  if (!recorder.file.is_open()) return;
+  recorder.header.duration_us =
+      static_cast<std::uint64_t>((SDL_GetPerformanceCounter() - recorder.started) * 1000000.0 / recorder.frequency);
+  recorder.file.seekp(0);
+  recorder.file.write(reinterpret_cast<const char*>(&recorder.header), sizeof(recorder.header));
+  recorder.file.close();
+}
+
+bool load_input_log(InputLog& log, const std::string& path, std::uint64_t program_hash) {
+  std::optional<std::string> data = load_txt(path);
+  if (!data || data->size() < sizeof(log.header)) return false;
+  std::memcpy(&log.header, data->data(), sizeof(log.header));
+  if (std::memcmp(log.header.magic, INPUT_LOG_MAGIC, sizeof(log.header.magic)) != 0 || log.header.version != INPUT_LOG_VERSION) {
+    return false;
+  }
+  if (log.header.program_hash != program_hash) {
+    std::cerr << "input log: " << path << " was recorded with a different script." << std::endl;
+    return false;
+  }
+  std::size_t pos = sizeof(log.header);
+  log.entries.resize(log.header.entries);
+  log.codes.clear();
+  for (InputLogEntry& entry : log.entries) {
+    if (pos + sizeof(entry) > data->size()) return false;
+    std::memcpy(&entry, data->data() + pos, sizeof(entry));
+    pos += sizeof(entry);
+    if (pos + entry.count * sizeof(std::uint16_t) > data->size()) return false;
+    for (std::uint16_t i = 0; i < entry.count; i++) {
+      std::uint16_t code;
+      std::memcpy(&code, data->data() + pos, sizeof(code));
+      pos += sizeof(code);
+      if (code >= SDL_NUM_SCANCODES) return false;
+      log.codes.push_back(code);
+    }
+  }
+  return true;
+}
+
+void replay_input(InputPlayer& player, InputState& input) {
+  const InputLog& log = *player.log;
+  input.previous = input.current;
+  while (player.next_entry < log.entries.size() && log.entries[player.next_entry].step <= player.step) {
+    for (std::uint16_t i = 0; i < log.entries[player.next_entry].count; i++) input.current.flip(log.codes[player.next_code++]);
+    player.next_entry++;
+  }
+  player.step++;
+}
+
+std::uint64_t state_digest(const EngineState& state) {
+  std::uint64_t hash = FNV_OFFSET_BASIS;
+  hash = hash_bytes(hash, state.variables.data(), state.variables.size() * sizeof(state.variables[0]));
+  for (std::size_t slot = 0; slot < state.sprites.ids.size(); slot++) {
+    hash = hash_bytes(hash, &state.sprites.ids[slot], sizeof(state.sprites.ids[slot]));
+    hash = hash_bytes(hash, &state.sprites.rects[slot].x, sizeof(state.sprites.rects[slot].x));
+    hash = hash_bytes(hash, &state.sprites.rects[slot].y, sizeof(state.sprites.rects[slot].y));
+  }
+  hash = hash_bytes(hash, state.texts.strings.data(), state.texts.strings.size() * sizeof(state.texts.strings[0]));
+  hash = hash_bytes(hash, state.texts.positions.data(), state.texts.positions.size() * sizeof(state.texts.positions[0]));
+  return hash;
+}
+
+std::uint64_t program_digest(const Program& program) {
+  std::uint64_t hash = FNV_OFFSET_BASIS;
+  hash = hash_bytes(hash, program.code.data(), program.code.size() * sizeof(Instruction));
+  hash = hash_bytes(hash, program.operands.data(), program.operands.size() * sizeof(Operand));
+  hash = hash_bytes(hash, program.labels.data(), program.labels.size() * sizeof(std::int32_t));
+  // ExprInstrには詰め物があるので項目ごとに求める
+  for (const ExprInstr& instr : program.expr_code) {
+    hash = hash_bytes(hash, &instr.op, sizeof(instr.op));
+    hash = hash_bytes(hash, &instr.slot, sizeof(instr.slot));
+    hash = hash_bytes(hash, &instr.value, sizeof(instr.value));
+  }
+  hash = hash_bytes(hash, program.expressions.data(), program.expressions.size() * sizeof(Expression));
+  for (const StringTable* table : {&program.strings, &program.symbols}) {
+    hash = hash_bytes(hash, table->offsets.data(), table->offsets.size() * sizeof(std::uint32_t));
+    if (!table->offsets.empty()) hash = hash_bytes(hash, table->chars, table->offsets[table->offsets.size() - 1]);
+  }
+  return hash;
+}
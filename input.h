@@ -0,0 +1,81 @@
+// キー入力と入力ログ
+#ifndef INPUT_H
+#define INPUT_H
+
+#include "engine.h"                   // エンジン全体で使う型と定数
+
+// 今押されているキーを読む(イベントを処理するスレッドで呼ぶ)
+void read_keyboard(KeyState& keys);
+
+// 現在のキーボードの状態をスナップショットに取り込む(押された・離された瞬間も分かるよう前回分を残す)
+void snapshot_input(InputState& input);
+
+// 入力ログ(ロジック更新ごとのキー入力の記録)
+// ヘッダの後に、キーが変わったロジック更新ごとにInputLogEntryと変わったキーのスキャンコード(uint16)が並ぶ
+const char INPUT_LOG_MAGIC[4] = {'E', 'G', 'E', 'I'};
+const std::uint32_t INPUT_LOG_VERSION = 2;
+
+struct InputLogHeader {
+  char magic[4];
+  std::uint32_t version;
+  double logic_hz;            // 記録したときのロジック更新の頻度
+  std::uint64_t duration_us;  // 記録した時間
+  std::uint64_t program_hash; // 記録したときのプログラムのprogram_digest(別のスクリプトで再生しないように)
+  std::uint32_t steps;        // 記録したロジック更新の回数
+  std::uint32_t entries;
+};
+
+struct InputLogEntry {
+  std::uint64_t time_us; // 記録を始めてからの時間
+  std::uint32_t step;    // 何回目のロジック更新か
+  std::uint16_t count;   // 押された・離されたキーの数
+  std::uint16_t reserved;
+};
+
+// キー入力を入力ログに書き出すもの
+struct InputRecorder {
+  std::ofstream file;
+  InputLogHeader header;
+  KeyState last;
+  Uint64 started;
+  Uint64 frequency;
+};
+
+// 記録を始める(回数などは閉じるときにヘッダを書き直して残す)
+bool init_input_recorder(InputRecorder& recorder, const std::string& path, double logic_hz, std::uint64_t program_hash);
+
+// ロジック更新1回分のキー入力を記録する(前回から変わったキーだけを書く)
+void record_input(InputRecorder& recorder, const KeyState& keys);
+
+// 記録を終える
+void close_input_recorder(InputRecorder& recorder);
+
+// 読み込んだ入力ログ
+struct InputLog {
+  InputLogHeader header;
+  std::vector<InputLogEntry> entries;
+  std::vector<std::uint16_t> codes; // entriesの順に、変わったキーのスキャンコードを並べたもの
+};
+
+// 入力ログを読み込む(壊れているか、program_hashと違うプログラムで記録したものならfalse)
+bool load_input_log(InputLog& log, const std::string& path, std::uint64_t program_hash);
+
+// 入力ログを先頭からロジック更新1回ずつ再生するもの
+struct InputPlayer {
+  const InputLog* log;
+  std::size_t next_entry;
+  std::size_t next_code;
+  std::uint32_t step;
+};
+
+// 次のロジック更新のキー入力をスナップショットに取り込む(再生するときにsnapshot_inputの代わりに呼ぶ)
+void replay_input(InputPlayer& player, InputState& input);
+
+// 変数と表示中の画像・文字列の位置からハッシュを求める(記録したときと再生したときで結果が同じか比べる)
+// 画像の大きさは読み込んだ画像によって変わるので含めない
+std::uint64_t state_digest(const EngineState& state);
+
+// プログラムの命令・オペランド・式・文字列からハッシュを求める(入力ログを記録したスクリプトか見分ける)
+std::uint64_t program_digest(const Program& program);
+
+#endif // INPUT_H
@@ -0,0 +1,245 @@
+#include "loop.h"                     // フレームの進め方と描画スレッド
+#include "vm.h"                       // コマンドとスクリプトの実行
+
+void init_frame_scheduler(FrameScheduler& sched, double logic_hz, bool vsync) {
+  sched.frequency = SDL_GetPerformanceFrequency();
+  sched.step_ticks = static_cast<Uint64>(sched.frequency / logic_hz);
+  sched.previous = SDL_GetPerformanceCounter();
+  sched.accumulator = sched.step_ticks; // 最初のフレームで1回更新する
+  sched.next_frame = sched.previous;
+  sched.vsync = vsync;
+  sched.stats = FrameStats{};
+}
+
+int begin_frame(FrameScheduler& sched) {
+  Uint64 now = SDL_GetPerformanceCounter();
+  Uint64 delta = now - sched.previous;
+  sched.previous = now;
+  record_frame_time(sched.stats, delta * 1000.0 / sched.frequency);
+
+  sched.accumulator += delta;
+  Uint64 steps = sched.accumulator / sched.step_ticks;
+  if (steps > MAX_LOGIC_STEPS_PER_FRAME) {
+    // 追いつけないほど遅れたら溜まった分は捨てる
+    steps = MAX_LOGIC_STEPS_PER_FRAME;
+    sched.accumulator = 0;
+  } else {
+    sched.accumulator -= steps * sched.step_ticks;
+  }
+  return static_cast<int>(steps);
+}
+
+void end_frame(FrameScheduler& sched) {
+  if (sched.vsync) return;
+
+  sched.next_frame += sched.step_ticks;
+  Uint64 now = SDL_GetPerformanceCounter();
+  if (now >= sched.next_frame) {
+    // 予定より遅れていたら今を基準にし直す
+    if (now - sched.next_frame > sched.step_ticks) sched.next_frame = now;
+    return;
+  }
+
+  // 残りが長ければOSに任せて眠り、最後の約1ミリ秒は回って待つ
+  Uint64 remaining_ms = (sched.next_frame - now) * 1000 / sched.frequency;
+  if (remaining_ms > 1) SDL_Delay(static_cast<Uint32>(remaining_ms - 1));
+  while (SDL_GetPerformanceCounter() < sched.next_frame) {
+  }
+}
+
+void handle_event(const SDL_Event& e, bool& redraw, bool& quit) {
+  switch (e.type) {
+  case SDL_QUIT:
+    quit = true;
+    break;
+  case SDL_WINDOWEVENT:
+    // 隠れていた部分の再描画などに備えて描き直す
+    redraw = true;
+    break;
+  }
+}
+
+void wait_frame(FrameScheduler& sched, bool& redraw, bool& quit) {
+  Uint64 now = SDL_GetPerformanceCounter();
+  if (now >= sched.next_frame) {
+    // 予定時刻を過ぎてから始まったフレームなので、次の予定時刻に進める
+    sched.next_frame += sched.step_ticks;
+    if (now >= sched.next_frame) {
+      if (now - sched.next_frame > sched.step_ticks) sched.next_frame = now;
+      return;
+    }
+  }
+
+  // 1ミリ秒未満の残りで空回りしないよう切り上げる
+  Uint64 remaining = sched.next_frame - now;
+  int timeout_ms = static_cast<int>((remaining * 1000 + sched.frequency - 1) / sched.frequency);
+  SDL_Event e;
+  if (SDL_WaitEventTimeout(&e, timeout_ms)) handle_event(e, redraw, quit);
+}
+
+// ---- ロジック更新と描画を別々のスレッドで行う(--render-threadのとき) ----
+
+// 1つの書き手と1つの読み手がロックせずに最新の値を受け渡す3面バッファ
+// 書き手と読み手はそれぞれ1面を持ち、残りの1面を原子的に交換する
+// 書き手は読み手を待たずに書き続け、読み手は書き終えた最新の面だけを受け取る
+template <typename T>
+struct TripleBuffer {
+  static const std::uint8_t FRESH = 4; // 交換用の面に読み手がまだ受け取っていない値がある
+  std::array<T, 3> buffers;
+  std::atomic<std::uint8_t> shared{1}; // 交換用の面の番号(とFRESH)
+  std::uint8_t writing = 0;            // 書き手の面
+  std::uint8_t reading = 2;            // 読み手の面
+};
+
+// 書き手が次に書く面
+template <typename T>
+T& write_buffer(TripleBuffer<T>& buffer) {
+  return buffer.buffers[buffer.writing];
+}
+
+// 書き終えた面を読み手に渡す
+template <typename T>
+void publish_buffer(TripleBuffer<T>& buffer) {
+  std::uint8_t previous = buffer.shared.exchange(buffer.writing | TripleBuffer<T>::FRESH, std::memory_order_acq_rel);
+  buffer.writing = previous & 3;
+}
+
+// 新しい値があれば受け取ってtrueを返す(無ければ読み手の面はそのまま)
+template <typename T>
+bool acquire_buffer(TripleBuffer<T>& buffer) {
+  if (!(buffer.shared.load(std::memory_order_relaxed) & TripleBuffer<T>::FRESH)) return false;
+  std::uint8_t previous = buffer.shared.exchange(buffer.reading, std::memory_order_acq_rel);
+  buffer.reading = previous & 3;
+  return true;
+}
+
+// 読み手が最後に受け取った面
+template <typename T>
+T& read_buffer(TripleBuffer<T>& buffer) {
+  return buffer.buffers[buffer.reading];
+}
+
+// ロジック更新の結果として描画スレッドに渡す、表示中の画像と文字列の写し
+// 写した後はロジック側から変更されないので、描画スレッドは好きなときに描ける
+struct DrawList {
+  SpriteStore sprites; // slot_ofは写さない
+  TextStore texts;     // slot_ofは写さない
+};
+
+// 表示中の画像と文字列を描画用に写す(容量は使い回す)
+void snapshot_draw_list(DrawList& list, EngineState& state) {
+  SpriteStore& sprites = state.sprites;
+  sort_sprites(sprites);
+  list.sprites.ids = sprites.ids;
+  list.sprites.regions = sprites.regions;
+  list.sprites.rects = sprites.rects;
+  list.sprites.z = sprites.z;
+  list.sprites.draw_order = sprites.draw_order;
+  list.sprites.order_dirty = false;
+  list.texts.strings = state.texts.strings;
+  list.texts.positions = state.texts.positions;
+}
+
+// ロジック更新を行うスレッドと描画スレッドの間で共有するもの
+struct LogicThread {
+  SDL_Renderer* renderer;
+  EngineState* state;
+  ActorPool* actors;
+  const Program* program;
+  std::uint64_t budget_us;
+  double logic_hz;
+  InputRecorder* recorder;
+  TripleBuffer<KeyState> keys;   // 描画スレッド→ロジック: キー入力
+  TripleBuffer<DrawList> draws;  // ロジック→描画スレッド: 描くもの
+  std::atomic<bool> quit{false};
+  std::thread thread;
+};
+
+// ロジック更新を行うスレッド
+// 描画とvsyncの待ちとは関係なく、固定間隔でスクリプトを実行して描くものを渡し続ける
+void logic_thread_main(LogicThread& logic) {
+  EngineState& state = *logic.state;
+  Profiler profiler{};
+  FrameScheduler sched;
+  init_frame_scheduler(sched, logic.logic_hz, false);
+  while (!logic.quit.load(std::memory_order_relaxed)) {
+    int logic_steps = begin_frame(sched);
+    reset_scratch(state.assets->texture_cache.scratch);
+    for (int step = 0; step < logic_steps; step++) {
+      acquire_buffer(logic.keys);
+      state.input.previous = state.input.current;
+      state.input.current = read_buffer(logic.keys);
+      record_input(*logic.recorder, state.input.current);
+      run_script(logic.renderer, state, *logic.program, logic.budget_us, profiler);
+      step_actors(*logic.actors, logic.renderer, state);
+    }
+    if (state.sprites.changed) {
+      snapshot_draw_list(write_buffer(logic.draws), state);
+      publish_buffer(logic.draws);
+      state.sprites.changed = false;
+    }
+    end_frame(sched);
+  }
+}
+
+void run_threaded_loop(SDL_Renderer* renderer, EngineState& state, ActorPool& actors, const Program& program,
+                       std::uint64_t budget_us, double logic_hz, bool vsync, bool retained, bool frame_stats, MetricsSink& metrics,
+                       InputRecorder& recorder) {
+  LogicThread logic;
+  logic.renderer = renderer;
+  logic.state = &state;
+  logic.actors = &actors;
+  logic.program = &program;
+  logic.budget_us = budget_us;
+  logic.logic_hz = logic_hz;
+  logic.recorder = &recorder;
+  read_keyboard(write_buffer(logic.keys));
+  publish_buffer(logic.keys);
+  logic.thread = std::thread(logic_thread_main, std::ref(logic));
+
+  SpriteBatch batch;
+  RenderQueue queue;
+  FrameScheduler sched;
+  init_frame_scheduler(sched, logic_hz, vsync);
+  Uint64 last_stats = sched.previous;
+  bool quit = false;
+  bool redraw = true;
+  while (!quit) {
+    begin_frame(sched);
+
+    SDL_Event e;
+    while (SDL_PollEvent(&e)) {
+      handle_event(e, redraw, quit);
+    }
+    if (quit) break;
+    read_keyboard(write_buffer(logic.keys));
+    publish_buffer(logic.keys);
+
+    // ロジック更新が新しく描くものを渡していれば受け取る(遅れていても前回のものを描く)
+    if (acquire_buffer(logic.draws)) redraw = true;
+    bool drawn = !retained || redraw;
+    if (drawn) {
+      DrawList& list = read_buffer(logic.draws);
+      SDL_RenderClear(renderer);
+      render_images(renderer, list.sprites, queue, batch);
+      render_texts(renderer, list.texts, state.assets->glyph_atlas, batch);
+      present_frame(renderer);
+      redraw = false;
+    }
+
+    if (frame_stats && sched.previous - last_stats >= sched.frequency) {
+      print_frame_stats(sched.stats);
+      last_stats = sched.previous;
+    }
+    dump_metrics(metrics);
+
+    if (retained && (!drawn || !vsync)) {
+      wait_frame(sched, redraw, quit);
+    } else {
+      end_frame(sched);
+    }
+  }
+
+  logic.quit = true;
+  logic.thread.join();
+}
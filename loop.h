@@ -0,0 +1,45 @@
+// フレームの進め方と描画スレッド
+#ifndef LOOP_H
+#define LOOP_H
+
+#include "engine.h"                   // エンジン全体で使う型と定数
+#include "metrics.h"                  // 運用中の計測値
+#include "input.h"                    // キー入力と入力ログ
+#include "profiler.h"                 // フレーム時間とプロファイラ
+#include "actors.h"                   // アクターとスレッドプール
+
+// 固定間隔のロジック更新とフレームの待ち合わせを受け持つスケジューラ
+// vsyncが有効ならSDL_RenderPresentが待つので自前では待たない
+struct FrameScheduler {
+  Uint64 frequency;   // パフォーマンスカウンタの1秒あたりの刻み数
+  Uint64 step_ticks;  // ロジック更新1回分の刻み数
+  Uint64 previous;    // 前のフレームが始まった時刻
+  Uint64 accumulator; // まだロジック更新に回していない時間
+  Uint64 next_frame;  // 次のフレームを始める予定の時刻
+  bool vsync;
+  FrameStats stats;
+};
+
+void init_frame_scheduler(FrameScheduler& sched, double logic_hz, bool vsync);
+
+// フレームの始めに呼び、このフレームで行うロジック更新の回数を返す
+int begin_frame(FrameScheduler& sched);
+
+// フレームの終わりに呼び、次のフレームの予定時刻まで待つ
+void end_frame(FrameScheduler& sched);
+
+// 1つのイベントを処理する
+void handle_event(const SDL_Event& e, bool& redraw, bool& quit);
+
+// retainedモードでフレームの終わりに呼び、次のフレームの予定時刻まで回らずに待つ
+// イベントが届いたらすぐに戻るので、その後のフレームではロジック更新が無いこともある
+void wait_frame(FrameScheduler& sched, bool& redraw, bool& quit);
+
+// ロジック更新を別のスレッドに任せ、このスレッドはイベントの処理と描画だけを行うメインループ
+// SDLのイベントと描画はウィンドウを作ったスレッドで扱う必要があるので、このスレッドが描画スレッドになる
+// 画像はロジック更新を始める前に全て読み込んでおく(実行中にテクスチャを作ったり捨てたりしない)
+void run_threaded_loop(SDL_Renderer* renderer, EngineState& state, ActorPool& actors, const Program& program,
+                       std::uint64_t budget_us, double logic_hz, bool vsync, bool retained, bool frame_stats, MetricsSink& metrics,
+                       InputRecorder& recorder);
+
+#endif // LOOP_H
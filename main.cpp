@@ -1,219 +1,255 @@
-#include <SDL2/SDL.h>                 // SDL2
-#include <SDL2/SDL_image.h>           // SDL2_image
-#include <string>                     // 文字列を扱う
-#include <vector>                     // 可変長配列
-#include <iostream>                   // 標準出力と標準エラー出力
-#include <tuple>                      // std::pairを使いたい
-#include <utility>                    // pairから値を取得するstd::getを使いたい
-#include <fstream>                    // ファイルを扱う
-#include <sstream>                    // ファイルを文字列ストリームとして扱う
-#include <optional>                   // 値が無い状態を扱えるstd::optionalを使いたい
-#include <map>                        // 連想配列を使いたい
-#include <functional>                 // 関数オブジェクトを使いたい
-#include <boost/algorithm/string.hpp> // 文字列のsplitを使いたい
-
-// ウィンドウサイズ
-const int SCREEN_WIDTH = 800;
-const int SCREEN_HEIGHT = 600;
-
-// コマンド名を数値にマッピングした型
-enum CommandName {
-  LABEL,
-  IMAGE,
-  CLEAR,
-  TEXT,
-  GOTO,
-  SET,
-  INPUT,
-  IF,
-  RETURN,
-};
-
-// コマンド名でCommandNameを引ける辞書として
-const std::map<std::string, CommandName> COMMAND_MAP = {
-  {"label", LABEL},
-  {"image", IMAGE},
-  {"clear", CLEAR},
-  {"text", TEXT},
-  {"goto", GOTO},
-  {"set", SET},
-  {"input", INPUT},
-  {"if", IF},
-  {"return", RETURN}
-};
-
-struct ImageState {
-  SDL_Texture* tex;
-  SDL_Rect rect;
-};
-
-struct EngineState {
-  std::map<std::string, SDL_Texture*> textures;
-  std::map<std::string, ImageState> draw_images;
-};
-
-using TypeName = std::string;
-using Value = std::string;
-using Parameter = std::pair<TypeName, Value>;
-using Command = std::pair<CommandName, std::vector<Parameter>>;
-using CommandFn = std::function<int(SDL_Renderer*, EngineState&, std::vector<Parameter>)>;
-
-int command_nop(SDL_Renderer* renderer, EngineState& state, std::vector<Parameter> params) {
-  return 0;
-}
-
-static std::map<CommandName, CommandFn> COMMAND_FN_MAP = {
-  {LABEL, command_nop},
-  {IMAGE, command_nop},
-  {TEXT, command_nop},
-  {GOTO, command_nop},
-  {SET, command_nop},
-  {INPUT, command_nop},
-  {IF, command_nop},
-  {RETURN, command_nop}
-};
-
-// ファイルの存在を確認する
-inline bool exists_file (const std::string& name) {
-    std::ifstream f(name.c_str());
-    return f.good();
-}
+#include "script.h"                   // スクリプトの解釈とコンパイル
+#include "vm.h"                       // コマンドとスクリプトの実行
+#include "metrics.h"                  // 運用中の計測値
+#include "text.h"                     // 文字列の描画に使うグリフアトラス
+#include "assets.h"                   // 画像の読み込みとテクスチャの管理
+#include "render.h"                   // 画像と文字列の描画
+#include "input.h"                    // キー入力と入力ログ
+#include "profiler.h"                 // フレーム時間とプロファイラ
+#include "actors.h"                   // アクターとスレッドプール
+#include "loop.h"                     // フレームの進め方と描画スレッド
+#include "reload.h"                   // スクリプトのホットリロード
+#include "bench.h"                    // マイクロベンチマーク
 
-// ファイルから文字列を読み込む
-std::optional<std::string>
-load_txt(const std::string pathstr)
+int
+main(int argc, char* args[])
 {
-  std::ifstream ifs(pathstr);
-
-  if (!ifs)
-    return std::nullopt;
-
-  std::stringstream ss;
-  ss << ifs.rdbuf();
-  ifs.close();
-
-  std::string data(ss.str());
-
-  return data;
-}
+  SDL_Window* window = NULL;
+  Assets assets{};
+  EngineState state{};
+  state.assets = &assets;
+  SDL_Surface* screenSurface = NULL;
+  SDL_Renderer* renderer;
+  // 1フレームでスクリプトの実行に使う時間(マイクロ秒)
+  std::uint64_t script_budget_us = DEFAULT_SCRIPT_BUDGET_US;
+  // ロジック更新の頻度(Hz)
+  double logic_hz = DEFAULT_LOGIC_HZ;
+  // trueなら画面の更新をディスプレイの垂直同期に合わせる
+  bool vsync = false;
+  // trueなら1秒ごとにフレーム時間の統計を出力する
+  bool frame_stats = false;
+  // 画像をデコードするスレッド数(0ならCPUのコア数)
+  unsigned load_threads = 0;
+  // trueなら描画内容が変わったフレームだけ描画し、それ以外はイベントを待って眠る
+  bool retained = false;
+  // textコマンドで使うフォント
+  std::string font_path = DEFAULT_FONT_PATH;
+  // trueなら画像を事前に全て読み込まず、使うときに読み込む
+  bool stream_textures = false;
+  // オンデマンド読み込み時のテクスチャの合計サイズ(MB)の上限
+  std::size_t texture_budget_mb = DEFAULT_TEXTURE_BUDGET_MB;
+  // 読み込むスクリプトのファイル
+  std::string script_path = "./script";
+  // 空でなければ、テキストのスクリプトの代わりに読み込むコンパイル済みのファイル
+  std::string program_path;
+  // 空でなければ、スクリプトをコンパイルしてこのファイルに書き出して終了する
+  std::string compile_output;
+  // trueなら読み込んだバイトコードを出力する(デバッグ用)
+  bool dump = false;
+  // trueならスクリプトファイルの更新を監視し、実行したまま読み直す
+  bool watch = false;
+  // trueならウィンドウを開かずにベンチマークを実行して終了する
+  bool bench = false;
+  // ベンチマークで計測する実際のスクリプト
+  std::vector<std::string> bench_scripts;
+  // trueなら区間・コマンド・ラベルごとの時間を測り、1秒ごとに画面と標準出力に報告する
+  bool profile = false;
+  // 空でなければ、測った区間をChrome trace形式(chrome://tracing)でこのファイルに書き出す
+  std::string trace_path;
+  // アクターを実行するスレッドの数(0ならCPUのコア数)
+  unsigned actor_threads = 0;
+  // trueならロジック更新を別のスレッドで行い、このスレッドは描画だけを行う
+  bool render_thread = false;
+  // 空でなければ、スクリプト中の画像をこのディレクトリにベイクして終了する
+  std::string bake_dir;
+  // trueならベイクするときに、いつも同じ大きさで表示する画像をその大きさにしておく
+  bool bake_scale = false;
+  // 空でなければ、このディレクトリのベイク済み画像を使う
+  std::string baked_dir;
+  // オンデマンド読み込みで、今のシーンから何回の移動で辿り着くシーンまでの画像を先読みするか
+  int scene_depth = DEFAULT_SCENE_DEPTH;
+  // 空でなければ、計測値をこのファイル(udp://host:portならそのアドレス)に書き出す
+  std::string metrics_target;
+  Uint32 metrics_interval_ms = METRICS_INTERVAL_MS;
+  // 空でなければ、ロジック更新ごとのキー入力をこのファイルに記録する
+  std::string record_path;
+  // 空でなければ、このファイルに記録したキー入力でスクリプトを画面なしで再生して終了する
+  std::string replay_path;
+  // 空でなければ、スクリプト中の画像をこのアーカイブにまとめて終了する
+  std::string pack_output;
+  // 空でなければ、画像をこのアーカイブから読む
+  std::string archive_path;
 
-// パラメータ位置にある文字列を解釈してParameter型に変換
-Parameter parse_param(const std::string& source) {
-	Parameter result;
-	bool is_a_number = false;
-    try
-    {
-      // 文字列を数値(浮動小数点数)だとみなして解釈を試みる
-      std::stod(source);
-      is_a_number = true;
-      result = std::make_pair("NUMBER", source);
+  // コマンドに対応する関数を登録
+  COMMAND_FN_MAP[IMAGE] = command_image;
+  COMMAND_FN_MAP[TEXT] = command_text;
+  COMMAND_FN_MAP[GOTO] = command_goto;
+  COMMAND_FN_MAP[INPUT] = command_input;
+  COMMAND_FN_MAP[SET] = command_set;
+  COMMAND_FN_MAP[IF] = command_if;
+  COMMAND_FN_MAP[RETURN] = command_return;
+  COMMAND_FN_MAP[WAIT] = command_wait;
+  COMMAND_FN_MAP[SPAWN] = command_spawn;
+  // 組み込み以外のコマンドは名前を付けて追加する
+  register_command("log", command_log);
+
+  // コマンドライン引数を解釈
+  for (int i = 1; i < argc; i++) {
+    if (std::strcmp(args[i], "--bench") == 0) {
+      bench = true;
+    } else if (std::strcmp(args[i], "--bench-script") == 0 && i + 1 < argc) {
+      bench_scripts.push_back(args[++i]);
+    } else if (std::strcmp(args[i], "--budget-us") == 0 && i + 1 < argc) {
+      script_budget_us = std::stoull(args[++i]);
+    } else if (std::strcmp(args[i], "--hz") == 0 && i + 1 < argc) {
+      logic_hz = std::stod(args[++i]);
+    } else if (std::strcmp(args[i], "--vsync") == 0) {
+      vsync = true;
+    } else if (std::strcmp(args[i], "--frame-stats") == 0) {
+      frame_stats = true;
+    } else if (std::strcmp(args[i], "--load-threads") == 0 && i + 1 < argc) {
+      load_threads = std::stoul(args[++i]);
+    } else if (std::strcmp(args[i], "--font") == 0 && i + 1 < argc) {
+      font_path = args[++i];
+    } else if (std::strcmp(args[i], "--retained") == 0) {
+      retained = true;
+    } else if (std::strcmp(args[i], "--stream-textures") == 0) {
+      stream_textures = true;
+    } else if (std::strcmp(args[i], "--texture-budget-mb") == 0 && i + 1 < argc) {
+      texture_budget_mb = std::stoull(args[++i]);
+    } else if (std::strcmp(args[i], "--script") == 0 && i + 1 < argc) {
+      script_path = args[++i];
+    } else if (std::strcmp(args[i], "--program") == 0 && i + 1 < argc) {
+      program_path = args[++i];
+    } else if (std::strcmp(args[i], "--compile") == 0 && i + 1 < argc) {
+      compile_output = args[++i];
+    } else if (std::strcmp(args[i], "--dump") == 0) {
+      dump = true;
+    } else if (std::strcmp(args[i], "--watch") == 0) {
+      watch = true;
+    } else if (std::strcmp(args[i], "--bake") == 0 && i + 1 < argc) {
+      bake_dir = args[++i];
+    } else if (std::strcmp(args[i], "--bake-scale") == 0) {
+      bake_scale = true;
+    } else if (std::strcmp(args[i], "--baked") == 0 && i + 1 < argc) {
+      baked_dir = args[++i];
+    } else if (std::strcmp(args[i], "--scene-depth") == 0 && i + 1 < argc) {
+      scene_depth = std::stoi(args[++i]);
+    } else if (std::strcmp(args[i], "--metrics") == 0 && i + 1 < argc) {
+      metrics_target = args[++i];
+    } else if (std::strcmp(args[i], "--metrics-interval-ms") == 0 && i + 1 < argc) {
+      metrics_interval_ms = std::stoul(args[++i]);
+    } else if (std::strcmp(args[i], "--record") == 0 && i + 1 < argc) {
+      record_path = args[++i];
+    } else if (std::strcmp(args[i], "--replay") == 0 && i + 1 < argc) {
+      replay_path = args[++i];
+    } else if (std::strcmp(args[i], "--pack") == 0 && i + 1 < argc) {
+      pack_output = args[++i];
+    } else if (std::strcmp(args[i], "--archive") == 0 && i + 1 < argc) {
+      archive_path = args[++i];
+    } else if (std::strcmp(args[i], "--render-thread") == 0) {
+      render_thread = true;
+    } else if (std::strcmp(args[i], "--actor-threads") == 0 && i + 1 < argc) {
+      actor_threads = std::stoul(args[++i]);
+    } else if (std::strcmp(args[i], "--profile") == 0) {
+      profile = true;
+    } else if (std::strcmp(args[i], "--trace") == 0 && i + 1 < argc) {
+      trace_path = args[++i];
+    } else {
+      std::cerr << "Unknown option: '" << args[i] << "'" << std::endl;
     }
-    catch(const std::exception &)
-    {
-      // 失敗したらダブルクォーテーションで囲まれているかどうかで解釈を変える
-      if (source.front() == '\"' && source.back() == '\"') {
-        result = std::make_pair("STRING", source.substr(1, source.size()-2));
-      } else {
-        // 上記のいずれでも無い場合はシンボルとして解釈
-        result = std::make_pair("SYMBOL", source);
-      }
+  }
+  InputLog replay;
+  if (!replay_path.empty()) {
+    // 入力ログは1つのスクリプトで記録したものなので、そのスクリプトにだけ再生する
+    if (bench && bench_scripts.size() != 1) {
+      std::cerr << "--replay with --bench needs exactly one --bench-script." << std::endl;
+      return 1;
     }
-	return result;
-}
-
-// スクリプト文字列を解釈してコマンド列に変換
-std::vector<Command>
-parse(const std::string& source)
-{
-  std::vector<Command> result;
-  std::vector<std::string> lines;
-
-  // スクリプト文字列を改行文字で区切る
-  boost::split(lines, source, boost::is_any_of("\n"));
-
-  // 行単位で処理
-  for (auto line : lines) {
-    // 空行は飛ばす
-    if (line == "") continue;
-
-    std::vector<std::string> tokens;
-    // 行をタブ文字で区切る
-    boost::split(tokens, line, boost::is_any_of("\t"));
-
-    CommandName name;
-    // 行頭の文字列をコマンド名として解釈
-    if (COMMAND_MAP.find(tokens[0]) != COMMAND_MAP.end()) {
-      name = COMMAND_MAP.at(tokens[0]);
-    } else {
-      // 予約済みのコマンド名と一致しなかったらエラー出力(その行は無視する)
-      std::cerr << "Invalid command name: '" << tokens[0] << "'" << std::endl;
-      continue;
+    const std::string& replay_script = bench ? bench_scripts[0] : script_path;
+    std::optional<std::string> replay_source = load_txt(replay_script);
+    if (!replay_source) {
+      std::cerr << "input log: " << replay_script << " could not be read." << std::endl;
+      return 1;
     }
-
-    std::vector<Parameter> parameters;
-    // 引数位置に文字列が存在する場合は1つずつParameterとして解釈
-    if (tokens.size() > 1) {
-      for (auto iter = tokens.begin()+1; iter != tokens.end(); iter++) {
-        Parameter param = parse_param(*iter);
-        parameters.push_back(param);
-      }
+    if (!load_input_log(replay, replay_path, program_digest(compile_source(*replay_source)))) {
+      std::cerr << "input log: " << replay_path << " could not be loaded." << std::endl;
+      return 1;
     }
-
-    result.push_back(make_pair(name, parameters));
+    if (!bench) return run_replay(script_path, replay, script_budget_us);
   }
-
-  return result;
-}
-
-// 画像を表示するコマンド
-int command_image(SDL_Renderer* renderer, EngineState& state, std::vector<Parameter> params) {
-  std::string id = std::get<1>(params[0]);
-  std::string img_path = std::get<1>(params[1]);
-  
-  if (state.textures.find(img_path) == state.textures.end()) {
-    std::cerr << "'image': " << img_path << " is not loaded." << std::endl;
-    return 1;
+  if (bench) return run_bench(bench_scripts, script_budget_us, replay_path.empty() ? NULL : &replay);
+
+  Program program;
+  ScriptCache script_cache;
+  if (!program_path.empty()) {
+    // コンパイル済みのファイルをmmapして読み込む(テキストの解釈は行わない)
+    std::optional<Program> loaded = load_program(program_path);
+    if (!loaded) {
+      std::cerr << "compiled script: " << program_path << " could not be loaded." << std::endl;
+      std::exit(1);
+    }
+    program = std::move(*loaded);
+  } else {
+    // スクリプト文字列をファイルから読み込む
+    std::string source = load_txt(script_path).value();
+
+    // スクリプト文字列をバイトコードに変換(リロードに備えてブロックごとの結果を残す)
+    std::vector<std::uint32_t> position_map;
+    program = update_script(script_cache, source, position_map);
+  }
+  if (watch && !program_path.empty()) {
+    std::cerr << "--watch is ignored for a compiled script." << std::endl;
+    watch = false;
+  }
+  if (render_thread) {
+    // 描画スレッドとロジック更新のスレッドのどちらかだけがテクスチャやプロファイラを触るようにはできないので使えない
+    if (stream_textures) std::cerr << "--stream-textures is ignored with --render-thread." << std::endl;
+    if (watch) std::cerr << "--watch is ignored with --render-thread." << std::endl;
+    if (profile || !trace_path.empty()) std::cerr << "--profile and --trace are ignored with --render-thread." << std::endl;
+    stream_textures = watch = profile = false;
+    trace_path.clear();
   }
 
-  SDL_Texture* tex = state.textures.at(img_path);
-  SDL_Rect rect;
-  rect.x = std::stoi(std::get<1>(params[2]));
-  rect.y = std::stoi(std::get<1>(params[3]));
-  rect.w = std::stoi(std::get<1>(params[4]));
-  rect.h = std::stoi(std::get<1>(params[5]));
-
-  ImageState imgst{tex, rect};
-  state.draw_images[id] = imgst;
-  return 0;
-}
-
-int
-main(int argc, char* args[])
-{
-  SDL_Window* window = NULL;
-  EngineState state{};
-  SDL_Surface* screenSurface = NULL;
-  SDL_Renderer* renderer;
-  // 現在処理中のコマンドのインデックス
-  int command_index = 0;
-
-  // スクリプト文字列をファイルから読み込む
-  std::string source = load_txt("./script").value();
+  if (dump) dump_program(program);
 
-  // スクリプト文字列を解釈してコマンド列に変換
-  auto commands = parse(source);
+  if (!compile_output.empty()) {
+    if (!save_program(program, compile_output)) {
+      std::cerr << "compiled script: " << compile_output << " could not be written." << std::endl;
+      return 1;
+    }
+    return 0;
+  }
 
-  // コマンド列を出力(デバッグ用)
-  for (auto cmd : commands) {
-    std::cout << std::get<0>(cmd) << ":";
-    for (auto param : std::get<1>(cmd)) {
-      std::cout << "<" << std::get<0>(param) << ">" << std::get<1>(param) << " ";
+  if (!bake_dir.empty()) {
+    IMG_Init(IMG_INIT_PNG | IMG_INIT_JPG);
+    bool baked = bake_assets(program, bake_dir, bake_scale);
+    IMG_Quit();
+    if (!baked) {
+      std::cerr << "bake: " << bake_dir << " could not be written." << std::endl;
+      return 1;
     }
-	  std::cout << std::endl;
+    return 0;
+  }
+  if (!baked_dir.empty() && !load_baked_assets(state.assets->sources.baked, baked_dir)) {
+    std::cerr << "baked images: " << baked_dir << " could not be loaded." << std::endl;
+  }
+  if (!pack_output.empty()) {
+    if (!pack_assets(program, state.assets->sources.baked, pack_output)) {
+      std::cerr << "archive: " << pack_output << " could not be written." << std::endl;
+      return 1;
+    }
+    return 0;
+  }
+  if (!archive_path.empty() && !load_asset_archive(state.assets->sources.archive, archive_path)) {
+    std::cerr << "archive: " << archive_path << " could not be loaded." << std::endl;
   }
 
-  // コマンドに対応する関数を登録
-  COMMAND_FN_MAP[IMAGE] = command_image;
+  state.assets->textures.assign(program.strings.size(), TextureRegion{});
+  state.variables.assign(program.symbols.size(), 0.0);
+  state.executed_frames.assign(program.code.size(), 0);
+  init_sprites(state.sprites, program.symbols.size());
+  init_texts(state.texts, program.strings.size());
 
   // Initialize SDL
   if (SDL_Init(SDL_INIT_VIDEO) < 0) {
@@ -233,83 +269,179 @@ main(int argc, char* args[])
     std::exit(1);
   }
 
-  renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
-
-  // スクリプト中の画像を事前にロードしておく
-  for (auto cmd: commands) {
-    // imageコマンドである
-    if (std::get<0>(cmd) == IMAGE) {
-      auto params = std::get<1>(cmd);
-      // 第2引数がある
-      if (params.size() < 2) {
-        std::cerr << "'image' command should have a file path at 2nd argument." << std::endl;
-        continue;
-      }
-      auto p2 = params[1];
-      // 第2引数の型がSTRINGである
-      if (std::get<0>(p2) != "STRING") {
-        std::cerr << "2nd argument of 'image' command should be a string." << std::endl;
-        continue;
+  Uint32 renderer_flags = SDL_RENDERER_ACCELERATED;
+  if (vsync) renderer_flags |= SDL_RENDERER_PRESENTVSYNC;
+  renderer = SDL_CreateRenderer(window, -1, renderer_flags);
+
+  // デコーダの初期化はスレッドから呼ばれる前に済ませておく
+  IMG_Init(IMG_INIT_PNG | IMG_INIT_JPG);
+
+  bool quit = false;
+  if (stream_textures) {
+    // 画像は使う直前に読み込み、実行位置の先にあるものを先読みする
+    init_texture_cache(state.assets->texture_cache, program, state.assets->sources, texture_budget_mb, scene_depth);
+  } else {
+    // スクリプト中の画像を事前にロードしておく
+    // デコードはワーカースレッドに任せ、その間は進捗を表示する
+    std::vector<SDL_Surface*> surfaces(program.strings.size(), NULL);
+    ImageLoader loader;
+    start_image_loader(loader, program, state.assets->sources, surfaces, load_threads);
+    while (!image_loader_finished(loader)) {
+      SDL_Event e;
+      while (SDL_PollEvent(&e)) {
+        if (e.type == SDL_QUIT) quit = true;
       }
-      std::string image_path = std::get<1>(p2);
-      // 第2引数で指定したファイルが存在する
-      if (!exists_file(image_path)) {
-        std::cerr << "file: " << image_path << " not found." << std::endl;
-        continue;
-      }
-      // 画像ファイルを読み込んでテクスチャにする
-      SDL_Texture* tex = IMG_LoadTexture(renderer, image_path.c_str());
-      // 画像パスとテクスチャを紐付けておく
-      state.textures[image_path] = tex;
+      draw_loading_screen(renderer, image_loader_progress(loader));
+      SDL_Delay(16);
     }
+    finish_image_loader(loader);
+    // 小さな画像をアトラスにまとめてテクスチャにする
+    upload_textures(renderer, state, surfaces);
+  }
+
+  // textコマンドで使う文字をグリフアトラスに描き込んでおく
+  if (TTF_Init() < 0) {
+    std::cerr << "SDL_ttf could not initialize! TTF_Error: " << TTF_GetError() << std::endl;
+  } else {
+    init_glyph_atlas(renderer, state.assets->glyph_atlas, font_path);
   }
+  layout_texts(state.assets->glyph_atlas, program);
 
   std::cout << "Textures are cached." << std::endl;
 
   // Get window surface
   screenSurface = SDL_GetWindowSurface(window);
-  
-  while (1) {
+
+  ScriptWatcher watcher;
+  if (watch) init_script_watcher(watcher, script_path);
+
+  Profiler profiler{};
+  if ((profile || !trace_path.empty()) && !init_profiler(profiler, program, profile, trace_path)) {
+    std::cerr << "trace: " << trace_path << " could not be opened." << std::endl;
+  }
+
+  ActorPool actors;
+  init_actor_pool(actors, program, actor_threads);
+
+  MetricsSink metrics{};
+  if (!metrics_target.empty() && !init_metrics_sink(metrics, metrics_target, metrics_interval_ms)) {
+    std::cerr << "metrics: " << metrics_target << " could not be opened." << std::endl;
+  }
+
+  InputRecorder recorder;
+  if (!record_path.empty() && !init_input_recorder(recorder, record_path, logic_hz, program_digest(program))) {
+    std::cerr << "input log: " << record_path << " could not be opened." << std::endl;
+  }
+  // 再生したときに同じ状態になるよう、記録中は時間でなく命令数で実行を打ち切る
+  if (recorder.file.is_open()) state.instruction_budget = REPLAY_STEP_INSTRUCTIONS;
+
+  if (render_thread && !quit) {
+    run_threaded_loop(renderer, state, actors, program, script_budget_us, logic_hz, vsync, retained, frame_stats, metrics, recorder);
+    quit = true;
+  }
+
+  SpriteBatch batch;
+  RenderQueue queue;
+  FrameScheduler sched;
+  init_frame_scheduler(sched, logic_hz, vsync);
+  Uint64 last_stats = sched.previous;
+  Uint64 last_profile = sched.previous;
+
+  while (!quit) {
+    int logic_steps = begin_frame(sched);
+    reset_scratch(state.assets->texture_cache.scratch);
+
+    // 溜まっているイベントは毎フレーム全て処理する
     SDL_Event e;
-    if (SDL_PollEvent(&e)) {
-      if (e.type == SDL_QUIT) {
-        break;
-      }
+    while (SDL_PollEvent(&e)) {
+      handle_event(e, state.sprites.changed, quit);
     }
+    if (quit) break;
 
-    SDL_RenderClear(renderer);
-
-    // 0. 未処理のコマンドがあるかチェック
-    if (command_index < commands.size()) {
-      // 1. 次のコマンドを取得
-      CommandName command_name;
-      std::vector<Parameter> params;
-      std::tie(command_name, params) = commands[command_index];
-      // 2. コマンド種類に応じて処理分け
-      COMMAND_FN_MAP[command_name](renderer, state, params);
-      command_index += 1;
+    // スクリプトが書き換えられていれば、実行を続けたまま読み直す
+    if (watch && script_changed(watcher)) {
+      reload_script(renderer, state, actors, program, script_cache, script_path);
+      if (profiler.enabled) index_profile_labels(profiler, program);
+    }
+
+    // 先読みの結果を受け取り、この先で使う画像の先読みを依頼する
+    update_texture_cache(renderer, state, program);
+
+    // ロジック更新1回ごとに、フレームを譲るか予算時間を使い切るまでスクリプトを実行
+    // キー入力はロジック更新ごとにスナップショットを取り、スクリプトはそれだけを見る
+    Uint64 zone_begin = profile_now(profiler);
+    for (int step = 0; step < logic_steps; step++) {
+      snapshot_input(state.input);
+      record_input(recorder, state.input.current);
+      run_script(renderer, state, program, script_budget_us, profiler);
+      step_actors(actors, renderer, state);
+    }
+    profile_zone(profiler, ZONE_VM, zone_begin);
+
+    // retainedモードでは描画内容が変わったときだけ描き直す
+    bool redraw = !retained || state.sprites.changed;
+    if (redraw) {
+      zone_begin = profile_now(profiler);
+      SDL_RenderClear(renderer);
+
+      // 表示中の画像を描画
+      render_images(renderer, state.sprites, queue, batch);
+      render_texts(renderer, state.texts, state.assets->glyph_atlas, batch);
+      render_profile_overlay(renderer, state, profiler, batch);
+      profile_zone(profiler, ZONE_DRAW, zone_begin);
+
+      // 画面の表示を更新
+      zone_begin = profile_now(profiler);
+      present_frame(renderer);
+      profile_zone(profiler, ZONE_PRESENT, zone_begin);
+      state.sprites.changed = false;
     }
+    profile_end_frame(profiler);
 
-    // 表示中の画像を描画
-    for (auto iter = state.draw_images.begin(); iter != state.draw_images.end(); ++iter) {
-      ImageState imgst = iter->second;
-      SDL_RenderCopy(renderer, imgst.tex, NULL, &imgst.rect);
+    if (frame_stats && sched.previous - last_stats >= sched.frequency) {
+      print_frame_stats(sched.stats);
+      last_stats = sched.previous;
+    }
+    update_texture_metrics(*state.assets);
+    dump_metrics(metrics);
+    if (profile && sched.previous - last_profile >= sched.frequency) {
+      std::string report = profile_report(profiler);
+      std::cout << report;
+      layout_string(state.assets->glyph_atlas, report, profiler.overlay_layout);
+      // retainedモードでも報告が変わったら描き直す
+      state.sprites.changed = true;
+      last_profile = sched.previous;
     }
 
-    // 画面の表示を更新
-    SDL_RenderPresent(renderer);
+    // 次のフレームの予定時刻まで待つ
+    // retainedモードでは描き直さなかったフレームはvsyncで待てないので、イベントを待ちながら眠る
+    if (retained && (!redraw || !vsync)) {
+      wait_frame(sched, state.sprites.changed, quit);
+    } else {
+      end_frame(sched);
+    }
+  }
 
-    // Wait two seconds
-    SDL_Delay(13);
+  close_profiler(profiler);
+  close_metrics_sink(metrics);
+  if (recorder.file.is_open()) {
+    std::cout << "record: " << recorder.header.steps << " steps, state " << std::hex << state_digest(state) << std::dec << std::endl;
+    close_input_recorder(recorder);
   }
+  destroy_actor_pool(actors);
 
-  // 事前にロードしたテクスチャを解放
-  for (auto iter = state.textures.begin(); iter != state.textures.end(); ++iter) {
-    SDL_DestroyTexture(iter->second);
+  // ロードしたテクスチャを解放
+  destroy_texture_cache(state.assets->texture_cache, state);
+  for (SDL_Texture* tex : state.assets->texture_pages) {
+    SDL_DestroyTexture(tex);
   }
 
+  destroy_glyph_atlas(state.assets->glyph_atlas);
+
   SDL_DestroyRenderer(renderer);
   SDL_DestroyWindow(window);
+  TTF_Quit();
+  IMG_Quit();
   SDL_Quit();
 
   return 0;
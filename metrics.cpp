@@ -0,0 +1,63 @@
+#include "metrics.h"                  // 運用中の計測値
+#include <unistd.h>                   // ソケットを閉じたい
+
+// ---- 運用中の計測値(定期的にファイルかUDPに1行のJSONで書き出す) ----
+
+const char* const METRIC_NAMES[METRIC_COUNT] = {
+  "frames", "commands", "draw_calls", "texture_bytes", "cache_hits", "cache_misses", "actors",
+};
+
+std::array<std::atomic<std::uint64_t>, METRIC_COUNT> METRICS{};
+
+bool init_metrics_sink(MetricsSink& sink, const std::string& target, Uint32 interval_ms) {
+  sink.socket = -1;
+  sink.interval_ms = interval_ms;
+  sink.started = sink.last_dump = SDL_GetTicks();
+  const std::string scheme = "udp://";
+  if (target.compare(0, scheme.size(), scheme) == 0) {
+    std::string host_port = target.substr(scheme.size());
+    std::size_t colon = host_port.rfind(':');
+    if (colon == std::string::npos) return false;
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    addrinfo* found = NULL;
+    if (getaddrinfo(host_port.substr(0, colon).c_str(), host_port.substr(colon + 1).c_str(), &hints, &found) != 0) return false;
+    sink.socket = ::socket(found->ai_family, found->ai_socktype, found->ai_protocol);
+    std::memcpy(&sink.address, found->ai_addr, found->ai_addrlen);
+    sink.address_size = found->ai_addrlen;
+    freeaddrinfo(found);
+    if (sink.socket < 0) return false;
+  } else {
+    sink.file.open(target, std::ios::app);
+    if (!sink.file) return false;
+  }
+  sink.enabled = true;
+  return true;
+}
+
+void dump_metrics(MetricsSink& sink) {
+  if (!sink.enabled) return;
+  Uint32 now = SDL_GetTicks();
+  if (now - sink.last_dump < sink.interval_ms) return;
+  sink.last_dump = now;
+
+  std::string line = "{\"uptime_ms\":" + std::to_string(now - sink.started);
+  for (int i = 0; i < METRIC_COUNT; i++) {
+    line += ",\"";
+    line += METRIC_NAMES[i];
+    line += "\":" + std::to_string(METRICS[i].load(std::memory_order_relaxed));
+  }
+  line += "}\n";
+  if (sink.socket >= 0) {
+    sendto(sink.socket, line.data(), line.size(), 0, reinterpret_cast<const sockaddr*>(&sink.address), sink.address_size);
+  } else {
+    sink.file << line << std::flush;
+  }
+}
+
+void close_metrics_sink(MetricsSink& sink) {
+  if (sink.socket >= 0) close(sink.socket);
+  sink.socket = -1;
+  sink.enabled = false;
+}
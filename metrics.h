@@ -0,0 +1,51 @@
+// 運用中の計測値
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "engine.h"                   // エンジン全体で使う型と定数
+#include <sys/socket.h>               // 計測値をUDPで送りたい
+#include <netdb.h>                    // 計測値の送り先の名前を解決したい
+
+enum MetricId {
+  METRIC_FRAMES,        // 描画したフレーム数(累計)
+  METRIC_COMMANDS,      // 実行した命令数(累計、アクターを含む)
+  METRIC_DRAW_CALLS,    // SDL_RenderGeometryの呼び出し数(累計)
+  METRIC_TEXTURE_BYTES, // 常駐しているテクスチャの推定サイズ
+  METRIC_CACHE_HITS,    // テクスチャキャッシュのヒット数(累計)
+  METRIC_CACHE_MISSES,  // テクスチャキャッシュのミス数(累計)
+  METRIC_ACTORS,        // 動いているアクターの数
+  METRIC_COUNT,
+};
+
+// どのスレッドからも足せるよう、値は全て原子的に扱う
+extern std::array<std::atomic<std::uint64_t>, METRIC_COUNT> METRICS;
+
+inline void add_metric(MetricId id, std::uint64_t n) {
+  METRICS[id].fetch_add(n, std::memory_order_relaxed);
+}
+
+inline void set_metric(MetricId id, std::uint64_t value) {
+  METRICS[id].store(value, std::memory_order_relaxed);
+}
+
+// 計測値の書き出し先
+struct MetricsSink {
+  bool enabled;
+  std::ofstream file;
+  int socket;               // udp://host:portのときのソケット(-1なら使わない)
+  sockaddr_storage address;
+  socklen_t address_size;
+  Uint32 interval_ms;
+  Uint32 started;
+  Uint32 last_dump;
+};
+
+// targetが"udp://host:port"ならそこへ送り、それ以外はファイルとみなして追記する
+bool init_metrics_sink(MetricsSink& sink, const std::string& target, Uint32 interval_ms);
+
+// 間隔が経っていれば計測値を1行書き出す
+void dump_metrics(MetricsSink& sink);
+
+void close_metrics_sink(MetricsSink& sink);
+
+#endif // METRICS_H
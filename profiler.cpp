@@ -0,0 +1,190 @@
+#include "profiler.h"                 // フレーム時間とプロファイラ
+#include "script.h"                   // スクリプトの解釈とコンパイル
+#include "vm.h"                       // コマンドとスクリプトの実行
+
+void record_frame_time(FrameStats& stats, double ms) {
+  stats.samples_ms[stats.next] = ms;
+  stats.next = (stats.next + 1) % FRAME_STATS_WINDOW;
+  if (stats.count < FRAME_STATS_WINDOW) stats.count += 1;
+}
+
+void print_frame_stats(const FrameStats& stats) {
+  if (stats.count == 0) return;
+  std::vector<double> sorted(stats.samples_ms.begin(), stats.samples_ms.begin() + stats.count);
+  std::sort(sorted.begin(), sorted.end());
+  double sum = 0.0;
+  for (double ms : sorted) sum += ms;
+  std::cout << "frame ms: avg " << sum / sorted.size()
+            << " p50 " << sorted[sorted.size() / 2]
+            << " p99 " << sorted[(sorted.size() - 1) * 99 / 100]
+            << " max " << sorted.back() << std::endl;
+}
+
+double stats_percentile(const FrameStats& stats, double p) {
+  if (stats.count == 0) return 0.0;
+  std::vector<double> sorted(stats.samples_ms.begin(), stats.samples_ms.begin() + stats.count);
+  std::sort(sorted.begin(), sorted.end());
+  return sorted[static_cast<std::size_t>((sorted.size() - 1) * p / 100.0)];
+}
+
+const char* const PROFILE_ZONE_NAMES[ZONE_COUNT] = {"vm", "draw", "present"};
+
+void index_profile_labels(Profiler& profiler, const Program& program) {
+  profiler.label_of.assign(program.code.size(), 0);
+  profiler.label_names.assign(1, "(top)");
+  for (std::size_t i = 0; i < program.code.size(); i++) {
+    const Instruction& inst = program.code[i];
+    if (inst.op == LABEL) profiler.label_names.emplace_back(program.symbols[program.operands[inst.operand_begin].index]);
+    profiler.label_of[i] = profiler.label_names.size() - 1;
+  }
+  profiler.label_ticks.assign(profiler.label_names.size(), 0);
+}
+
+bool init_profiler(Profiler& profiler, const Program& program, bool overlay, const std::string& trace_path) {
+  profiler.enabled = true;
+  profiler.overlay = overlay;
+  profiler.frequency = SDL_GetPerformanceFrequency();
+  profiler.zone_ticks.fill(0);
+  profiler.command_ticks.fill(0);
+  index_profile_labels(profiler, program);
+  profiler.span_open = false;
+  profiler.trace_origin = SDL_GetPerformanceCounter();
+  if (trace_path.empty()) return true;
+  profiler.trace.open(trace_path);
+  if (!profiler.trace) return false;
+  profiler.trace << "{\"traceEvents\":[";
+  profiler.trace_first = true;
+  return true;
+}
+
+// JSONの文字列として書き出す
+void write_json_string(std::ostream& os, std::string_view str) {
+  os << '"';
+  for (char c : str) {
+    if (c == '"' || c == '\\') {
+      os << '\\' << c;
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      char buf[8];
+      std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+      os << buf;
+    } else {
+      os << c;
+    }
+  }
+  os << '"';
+}
+
+// 区間を1つChrome traceの完了イベントとして書き出す(時刻はマイクロ秒)
+void write_trace_event(Profiler& profiler, std::string_view name, const char* category, Uint64 begin, Uint64 end) {
+  if (!profiler.trace.is_open()) return;
+  double ts = (begin - profiler.trace_origin) * 1e6 / profiler.frequency;
+  double dur = (end - begin) * 1e6 / profiler.frequency;
+  profiler.trace << (profiler.trace_first ? "\n" : ",\n") << "{\"name\":";
+  write_json_string(profiler.trace, name);
+  profiler.trace << ",\"cat\":\"" << category << "\",\"ph\":\"X\",\"ts\":" << ts << ",\"dur\":" << dur
+                 << ",\"pid\":0,\"tid\":0}";
+  profiler.trace_first = false;
+}
+
+void close_profiler(Profiler& profiler) {
+  if (!profiler.trace.is_open()) return;
+  profiler.trace << "\n]}\n";
+  profiler.trace.close();
+}
+
+void profile_zone(Profiler& profiler, ProfileZone zone, Uint64 begin) {
+  if (!profiler.enabled) return;
+  Uint64 end = SDL_GetPerformanceCounter();
+  profiler.zone_ticks[zone] += end - begin;
+  write_trace_event(profiler, PROFILE_ZONE_NAMES[zone], "zone", begin, end);
+}
+
+void flush_profile_span(Profiler& profiler) {
+  if (!profiler.span_open) return;
+  write_trace_event(profiler, profiler.label_names[profiler.span_label], "label", profiler.span_begin, profiler.span_end);
+  profiler.span_open = false;
+}
+
+void profile_command(Profiler& profiler, CommandName op, std::size_t index, Uint64 begin, Uint64 end) {
+  std::uint32_t label = profiler.label_of[index];
+  profiler.command_ticks[op] += end - begin;
+  profiler.label_ticks[label] += end - begin;
+  if (!profiler.trace.is_open()) return;
+  if (profiler.span_open && profiler.span_label != label) flush_profile_span(profiler);
+  if (!profiler.span_open) {
+    profiler.span_open = true;
+    profiler.span_label = label;
+    profiler.span_begin = begin;
+  }
+  profiler.span_end = end;
+}
+
+void profile_end_frame(Profiler& profiler) {
+  if (!profiler.enabled) return;
+  for (int i = 0; i < ZONE_COUNT; i++) {
+    record_frame_time(profiler.zones[i], profiler.zone_ticks[i] * 1000.0 / profiler.frequency);
+  }
+  for (int i = 0; i < REGISTERED_COMMAND_COUNT; i++) {
+    record_frame_time(profiler.commands[i], profiler.command_ticks[i] * 1000.0 / profiler.frequency);
+  }
+  profiler.zone_ticks.fill(0);
+  profiler.command_ticks.fill(0);
+}
+
+std::string profile_report(Profiler& profiler) {
+  const int top_count = 3;
+  std::ostringstream ss;
+  ss.setf(std::ios::fixed);
+  ss.precision(3);
+  auto line = [&](const char* name, const FrameStats& stats) {
+    ss << name << ": p50 " << stats_percentile(stats, 50) << " p95 " << stats_percentile(stats, 95)
+       << " p99 " << stats_percentile(stats, 99) << " ms\n";
+  };
+  for (int i = 0; i < ZONE_COUNT; i++) line(PROFILE_ZONE_NAMES[i], profiler.zones[i]);
+
+  // p95の大きいコマンドから
+  std::vector<std::pair<double, int>> commands;
+  for (int i = 0; i < REGISTERED_COMMAND_COUNT; i++) {
+    double p95 = stats_percentile(profiler.commands[i], 95);
+    if (p95 > 0.0) commands.emplace_back(p95, i);
+  }
+  std::sort(commands.rbegin(), commands.rend());
+  for (int i = 0; i < top_count && i < static_cast<int>(commands.size()); i++) {
+    line(command_name(static_cast<CommandName>(commands[i].second)), profiler.commands[commands[i].second]);
+  }
+
+  std::vector<std::pair<Uint64, std::uint32_t>> labels;
+  for (std::uint32_t i = 0; i < profiler.label_ticks.size(); i++) {
+    if (profiler.label_ticks[i] > 0) labels.emplace_back(profiler.label_ticks[i], i);
+  }
+  std::sort(labels.rbegin(), labels.rend());
+  for (int i = 0; i < top_count && i < static_cast<int>(labels.size()); i++) {
+    ss << "label " << profiler.label_names[labels[i].second] << ": "
+       << labels[i].first * 1000.0 / profiler.frequency << " ms\n";
+  }
+  std::fill(profiler.label_ticks.begin(), profiler.label_ticks.end(), 0);
+  return ss.str();
+}
+
+void render_profile_overlay(SDL_Renderer* renderer, const EngineState& state, const Profiler& profiler, SpriteBatch& batch) {
+  const TextLayout& layout = profiler.overlay_layout;
+  if (!profiler.overlay || layout.rects.empty()) return;
+  const int margin = 4;
+  SDL_Rect back{0, 0, 0, 0};
+  for (const auto& rect : layout.rects) {
+    back.w = std::max(back.w, rect.x + rect.w + margin * 2);
+    back.h = std::max(back.h, rect.y + rect.h + margin * 2);
+  }
+  SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
+  SDL_SetRenderDrawColor(renderer, 0, 0, 0, 160);
+  SDL_RenderFillRect(renderer, &back);
+  SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+
+  for (std::size_t i = 0; i < layout.regions.size(); i++) {
+    SDL_Rect rect = layout.rects[i];
+    rect.x += margin;
+    rect.y += margin;
+    push_sprite(batch, layout.regions[i], rect);
+  }
+  flush_batch(renderer, state.assets->glyph_atlas.tex, batch);
+}
@@ -0,0 +1,90 @@
+// フレーム時間とプロファイラ
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include "engine.h"                   // エンジン全体で使う型と定数
+#include "render.h"                   // 画像と文字列の描画
+
+// 直近のフレーム時間(ミリ秒)を記録するリングバッファ
+struct FrameStats {
+  std::array<double, FRAME_STATS_WINDOW> samples_ms;
+  std::size_t count;
+  std::size_t next;
+};
+
+// フレーム時間を1つ記録する
+void record_frame_time(FrameStats& stats, double ms);
+
+// 記録したフレーム時間の平均・中央値・99パーセンタイル・最大を出力する
+void print_frame_stats(const FrameStats& stats);
+
+// FrameStatsに記録した値のパーセンタイル(pは0から100)
+double stats_percentile(const FrameStats& stats, double p);
+
+// プロファイラで時間を測る区間
+enum ProfileZone {
+  ZONE_VM,      // スクリプトの実行
+  ZONE_DRAW,    // 画像と文字列の描画
+  ZONE_PRESENT, // SDL_RenderPresent
+  ZONE_COUNT,
+};
+
+// 区間ごと・コマンドごと・ラベルごとの時間を測るプロファイラ(--profile, --traceで有効にする)
+// 区間とコマンドはフレームごとの合計時間を直近のフレーム数だけ持ち、パーセンタイルを出す
+struct Profiler {
+  bool enabled;
+  bool overlay;
+  Uint64 frequency;
+  std::array<Uint64, ZONE_COUNT> zone_ticks;        // このフレームの区間ごとの時間
+  std::array<FrameStats, ZONE_COUNT> zones;
+  std::array<Uint64, MAX_COMMANDS> command_ticks;  // このフレームのコマンドごとの時間
+  std::array<FrameStats, MAX_COMMANDS> commands;
+  std::vector<std::uint32_t> label_of;              // 命令→その命令が属するラベルの番号
+  std::vector<std::string> label_names;             // ラベルの番号→名前(0番は最初のラベルより前)
+  std::vector<Uint64> label_ticks;                  // 前回の報告からのラベルごとの時間
+  // Chrome trace形式で書き出す場合の出力先と、まとめ中のラベルの区間
+  std::ofstream trace;
+  bool trace_first;
+  Uint64 trace_origin;
+  bool span_open;
+  std::uint32_t span_label;
+  Uint64 span_begin, span_end;
+  // 画面に重ねて表示する報告
+  TextLayout overlay_layout;
+};
+
+// 命令ごとに属するラベルを求めておく(ホットリロードしたら呼び直す)
+void index_profile_labels(Profiler& profiler, const Program& program);
+
+// trace_pathが空でなければ、そのファイルにChrome trace形式で書き出す
+bool init_profiler(Profiler& profiler, const Program& program, bool overlay, const std::string& trace_path);
+
+// 書き出し中のtraceを閉じる
+void close_profiler(Profiler& profiler);
+
+// 計測を始める時刻(無効なら0)
+inline Uint64 profile_now(const Profiler& profiler) {
+  return profiler.enabled ? SDL_GetPerformanceCounter() : 0;
+}
+
+// beginから今までを区間の時間として加える
+void profile_zone(Profiler& profiler, ProfileZone zone, Uint64 begin);
+
+// まとめ中のラベルの区間を書き出す
+void flush_profile_span(Profiler& profiler);
+
+// 命令1つの実行時間を加える
+// traceには命令ごとではなく、同じラベルの命令が続いた区間を1つのイベントとして書き出す
+void profile_command(Profiler& profiler, CommandName op, std::size_t index, Uint64 begin, Uint64 end);
+
+// フレームの終わりに呼び、このフレームで測った時間を記録する
+void profile_end_frame(Profiler& profiler);
+
+// 区間とコマンドのパーセンタイルと、前回から時間のかかったラベルをまとめる
+// ラベルの時間は報告するたびに0に戻す
+std::string profile_report(Profiler& profiler);
+
+// 報告を画面の左上に半透明の背景付きで重ねて描画する
+void render_profile_overlay(SDL_Renderer* renderer, const EngineState& state, const Profiler& profiler, SpriteBatch& batch);
+
+#endif // PROFILER_H
@@ -0,0 +1,114 @@
+#include "reload.h"                   // スクリプトのホットリロード
+#include "text.h"                     // 文字列の描画に使うグリフアトラス
+#include "assets.h"                   // 画像の読み込みとテクスチャの管理
+
+void init_script_watcher(ScriptWatcher& watcher, const std::string& path) {
+  struct stat st{};
+  stat(path.c_str(), &st);
+  watcher.path = path;
+  watcher.mtime = st.st_mtim;
+  watcher.size = st.st_size;
+  watcher.last_check = SDL_GetTicks();
+}
+
+bool script_changed(ScriptWatcher& watcher) {
+  Uint32 now = SDL_GetTicks();
+  if (now - watcher.last_check < SCRIPT_WATCH_INTERVAL_MS) return false;
+  watcher.last_check = now;
+
+  struct stat st{};
+  if (stat(watcher.path.c_str(), &st) != 0) return false;
+  if (st.st_mtim.tv_sec == watcher.mtime.tv_sec && st.st_mtim.tv_nsec == watcher.mtime.tv_nsec && st.st_size == watcher.size) {
+    return false;
+  }
+  watcher.mtime = st.st_mtim;
+  watcher.size = st.st_size;
+  return true;
+}
+
+// 実行位置と戻り先を新しいプログラムの対応する位置に移し、増えたシンボルなどの分だけ置き場を広げる
+void remap_context(EngineState& state, const Program& program, const std::vector<std::uint32_t>& position_map) {
+  auto remap = [&](std::size_t pos) { return position_map[std::min(pos, position_map.size() - 1)]; };
+  state.command_index = remap(state.command_index);
+  for (std::uint32_t i = 0; i < state.call_depth; i++) state.call_stack[i] = remap(state.call_stack[i]);
+
+  state.variables.resize(program.symbols.size(), 0.0);
+  state.executed_frames.assign(program.code.size(), 0);
+  state.image_slots.clear();
+  state.sprites.slot_of.resize(std::max(state.sprites.slot_of.size(), program.symbols.size()), -1);
+  state.sprites.changed = true;
+  state.texts.slot_of.resize(std::max(state.texts.slot_of.size(), program.strings.size()), -1);
+}
+
+// シンボルや文字列が増えたら、メインの表示に合成したアクターの画像と文字列を新しいidで合成し直す
+// メインのスクリプト自身の画像と文字列はそのまま残す
+void restride_actor_output(ActorPool& pool, EngineState& main_state, std::uint32_t old_sprite_stride, std::uint32_t old_text_stride) {
+  std::size_t groups = pool.actors.size() + 1;
+  if (pool.actors.empty() || (pool.sprite_stride == old_sprite_stride && pool.text_stride == old_text_stride)) {
+    main_state.sprites.slot_of.resize(std::max(main_state.sprites.slot_of.size(), groups * pool.sprite_stride), -1);
+    main_state.texts.slot_of.resize(std::max(main_state.texts.slot_of.size(), groups * pool.text_stride), -1);
+    return;
+  }
+  drop_actor_output(pool, main_state, old_sprite_stride);
+}
+
+void reload_script(SDL_Renderer* renderer, EngineState& state, ActorPool& actors, Program& program, ScriptCache& cache, const std::string& path) {
+  std::optional<std::string> source = load_txt(path);
+  if (!source) {
+    std::cerr << "script: " << path << " could not be reloaded." << std::endl;
+    return;
+  }
+  std::vector<bool> had_image(program.strings.size(), false);
+  for (std::uint32_t path_index : collect_image_paths(program)) had_image[path_index] = true;
+
+  std::vector<std::uint32_t> position_map;
+  Program next = update_script(cache, *source, position_map);
+  TextureCache& texture_cache = state.assets->texture_cache;
+  if (texture_cache.enabled) {
+    // 先読みスレッドはロック中にだけprogramを見る
+    std::lock_guard<std::mutex> lock(texture_cache.prefetcher.mutex);
+    program = std::move(next);
+  } else {
+    program = std::move(next);
+  }
+
+  state.assets->textures.resize(program.strings.size(), TextureRegion{});
+  remap_context(state, program, position_map);
+  std::uint32_t old_sprite_stride = actors.sprite_stride;
+  std::uint32_t old_text_stride = actors.text_stride;
+  index_actor_program(actors, program);
+  for (auto& actor : actors.actors) {
+    remap_context(*actor, program, position_map);
+    actor->sprites.changed = true;
+  }
+  restride_actor_output(actors, state, old_sprite_stride, old_text_stride);
+
+  if (texture_cache.enabled) {
+    texture_cache.last_used.resize(program.strings.size(), 0);
+    texture_cache.bytes.resize(program.strings.size(), 0);
+    texture_cache.requested.resize(program.strings.size(), 0);
+    texture_cache.missing.resize(program.strings.size(), 0);
+    index_next_images(texture_cache, program);
+    index_scenes(texture_cache, program);
+  } else {
+    // 事前読み込みのアトラスは作り直さず、新しい画像は単独のテクスチャにする
+    for (std::uint32_t path_index : collect_image_paths(program)) {
+      if (path_index < had_image.size() && had_image[path_index]) continue;
+      if (state.assets->textures[path_index].tex != NULL) continue;
+      const char* image_path = program.strings.c_str(path_index);
+      SDL_Surface* surface = load_image(state.assets->sources, image_path);
+      if (surface == NULL) {
+        std::cerr << "file: " << image_path << " not found." << std::endl;
+        continue;
+      }
+      SDL_Texture* tex = SDL_CreateTextureFromSurface(renderer, surface);
+      state.assets->texture_pages.push_back(tex);
+      state.assets->textures[path_index] = make_region(tex, SDL_Rect{0, 0, surface->w, surface->h}, surface->w, surface->h);
+      add_metric(METRIC_TEXTURE_BYTES, static_cast<std::uint64_t>(surface->w) * surface->h * 4);
+      SDL_FreeSurface(surface);
+    }
+  }
+
+  // グリフは描き込み済みのものを使い回すので、新しい文字だけラスタライズされる
+  layout_texts(state.assets->glyph_atlas, program);
+}
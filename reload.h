@@ -0,0 +1,29 @@
+// スクリプトのホットリロード
+#ifndef RELOAD_H
+#define RELOAD_H
+
+#include "engine.h"                   // エンジン全体で使う型と定数
+#include "script.h"                   // スクリプトの解釈とコンパイル
+#include "actors.h"                   // アクターとスレッドプール
+#include <sys/stat.h>                 // スクリプトファイルの更新時刻を知りたい
+
+// スクリプトファイルの更新を調べるための情報
+struct ScriptWatcher {
+  std::string path;
+  struct timespec mtime;
+  off_t size;
+  Uint32 last_check;
+};
+
+void init_script_watcher(ScriptWatcher& watcher, const std::string& path);
+
+// 一定間隔でファイルの更新時刻と大きさを調べ、変わっていればtrueを返す
+bool script_changed(ScriptWatcher& watcher);
+
+// スクリプトを読み直して差し替える
+// 文字列とシンボルのインデックスは変わらないので、テクスチャや変数、表示中の画像はそのまま残し、
+// 増えた分だけ置き場を広げる。画像は新しく参照されたものだけ読み込む
+// アクターも実行位置を移して動かし続ける
+void reload_script(SDL_Renderer* renderer, EngineState& state, ActorPool& actors, Program& program, ScriptCache& cache, const std::string& path);
+
+#endif // RELOAD_H
@@ -0,0 +1,192 @@
+#include "render.h"                   // 画像と文字列の描画
+
+void init_texts(TextStore& texts, std::size_t string_count) {
+  texts.slot_of.assign(string_count, -1);
+  texts.strings.clear();
+  texts.positions.clear();
+}
+
+void init_sprites(SpriteStore& sprites, std::size_t symbol_count) {
+  sprites.slot_of.assign(symbol_count, -1);
+  sprites.ids.clear();
+  sprites.regions.clear();
+  sprites.rects.clear();
+  sprites.z.clear();
+  sprites.draw_order.clear();
+  sprites.order_dirty = false;
+  sprites.changed = true;
+}
+
+std::int32_t set_sprite(SpriteStore& sprites, std::uint32_t id, const TextureRegion& region, const SDL_Rect& rect, std::int32_t z) {
+  std::int32_t slot = sprites.slot_of[id];
+  if (slot < 0) {
+    slot = sprites.ids.size();
+    sprites.slot_of[id] = slot;
+    sprites.ids.push_back(id);
+    sprites.regions.push_back(region);
+    sprites.rects.push_back(rect);
+    sprites.z.push_back(z);
+    sprites.draw_order.push_back(slot);
+    sprites.order_dirty = true;
+    sprites.changed = true;
+    return slot;
+  }
+  update_sprite(sprites, slot, region, rect, z);
+  return slot;
+}
+
+void sort_sprites(SpriteStore& sprites) {
+  if (!sprites.order_dirty) return;
+  std::sort(sprites.draw_order.begin(), sprites.draw_order.end(), [&](std::uint32_t a, std::uint32_t b) {
+    return sprites.z[a] != sprites.z[b] ? sprites.z[a] < sprites.z[b] : a < b;
+  });
+  sprites.order_dirty = false;
+}
+
+bool set_text(TextStore& texts, std::uint32_t key, std::uint32_t string_index, SDL_Point pos) {
+  std::int32_t slot = texts.slot_of[key];
+  if (slot < 0) {
+    texts.slot_of[key] = texts.strings.size();
+    texts.strings.push_back(string_index);
+    texts.positions.push_back(pos);
+    return true;
+  }
+  if (texts.positions[slot].x != pos.x || texts.positions[slot].y != pos.y) {
+    texts.positions[slot] = pos;
+    return true;
+  }
+  return false;
+}
+
+void draw_loading_screen(SDL_Renderer* renderer, float progress) {
+  const int bar_w = SCREEN_WIDTH / 2;
+  const int bar_h = 16;
+  SDL_Rect frame{(SCREEN_WIDTH - bar_w) / 2, (SCREEN_HEIGHT - bar_h) / 2, bar_w, bar_h};
+  SDL_Rect bar{frame.x, frame.y, static_cast<int>(bar_w * progress), bar_h};
+
+  SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+  SDL_RenderClear(renderer);
+  SDL_SetRenderDrawColor(renderer, 64, 64, 64, 255);
+  SDL_RenderFillRect(renderer, &frame);
+  SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
+  SDL_RenderFillRect(renderer, &bar);
+  SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+  SDL_RenderPresent(renderer);
+}
+
+void push_sprite(SpriteBatch& batch, const TextureRegion& r, const SDL_Rect& rect) {
+  float x0 = rect.x, y0 = rect.y;
+  float x1 = x0 + rect.w, y1 = y0 + rect.h;
+  SDL_Color white{255, 255, 255, 255};
+  int base = batch.vertices.size();
+  batch.vertices.push_back(SDL_Vertex{SDL_FPoint{x0, y0}, white, SDL_FPoint{r.u0, r.v0}});
+  batch.vertices.push_back(SDL_Vertex{SDL_FPoint{x1, y0}, white, SDL_FPoint{r.u1, r.v0}});
+  batch.vertices.push_back(SDL_Vertex{SDL_FPoint{x1, y1}, white, SDL_FPoint{r.u1, r.v1}});
+  batch.vertices.push_back(SDL_Vertex{SDL_FPoint{x0, y1}, white, SDL_FPoint{r.u0, r.v1}});
+  for (int i : {0, 1, 2, 0, 2, 3}) batch.indices.push_back(base + i);
+}
+
+void flush_batch(SDL_Renderer* renderer, SDL_Texture* tex, SpriteBatch& batch) {
+  if (batch.indices.empty()) return;
+  add_metric(METRIC_DRAW_CALLS, 1);
+  SDL_RenderGeometry(renderer, tex, batch.vertices.data(), batch.vertices.size(),
+                     batch.indices.data(), batch.indices.size());
+  batch.vertices.clear();
+  batch.indices.clear();
+}
+
+// z順に並んだ画像を、画面外のものを除いてテクスチャごとのまとまりに分ける
+// ある画像を同じテクスチャの前のまとまりに入れて先に描いても、その後のまとまりの画像と
+// 重ならなければ見た目は変わらない。重なりは画像が掛かるマスで調べる(同じマスなら重なるとみなす)
+void build_render_queue(RenderQueue& queue, const SpriteStore& sprites) {
+  queue.grid_w = (SCREEN_WIDTH + RENDER_GRID_CELL - 1) / RENDER_GRID_CELL;
+  queue.grid_h = (SCREEN_HEIGHT + RENDER_GRID_CELL - 1) / RENDER_GRID_CELL;
+  queue.cell_batch.assign(queue.grid_w * queue.grid_h, -1);
+  queue.latest.clear();
+  queue.batch_tex.clear();
+  queue.entries.clear();
+  queue.visible = queue.culled = 0;
+
+  for (std::uint32_t slot : sprites.draw_order) {
+    const SDL_Rect& rect = sprites.rects[slot];
+    // 画面と重ならない画像は描かない
+    if (rect.w <= 0 || rect.h <= 0 || rect.x >= SCREEN_WIDTH || rect.y >= SCREEN_HEIGHT ||
+        rect.x + rect.w <= 0 || rect.y + rect.h <= 0) {
+      queue.culled += 1;
+      continue;
+    }
+    queue.visible += 1;
+    int cx0 = std::max(rect.x, 0) / RENDER_GRID_CELL;
+    int cy0 = std::max(rect.y, 0) / RENDER_GRID_CELL;
+    int cx1 = (std::min(rect.x + rect.w, SCREEN_WIDTH) - 1) / RENDER_GRID_CELL;
+    int cy1 = (std::min(rect.y + rect.h, SCREEN_HEIGHT) - 1) / RENDER_GRID_CELL;
+
+    // 掛かるマスに後から描かれたまとまりの中で最も新しいもの
+    std::int32_t above = -1;
+    for (int cy = cy0; cy <= cy1; cy++) {
+      for (int cx = cx0; cx <= cx1; cx++) above = std::max(above, queue.cell_batch[cy * queue.grid_w + cx]);
+    }
+    SDL_Texture* tex = sprites.regions[slot].tex;
+    auto found = queue.latest.find(tex);
+    std::int32_t batch;
+    if (found != queue.latest.end() && found->second >= above) {
+      batch = found->second;
+    } else {
+      batch = queue.batch_tex.size();
+      queue.batch_tex.push_back(tex);
+      queue.latest[tex] = batch;
+    }
+    for (int cy = cy0; cy <= cy1; cy++) {
+      for (int cx = cx0; cx <= cx1; cx++) {
+        std::int32_t& cell = queue.cell_batch[cy * queue.grid_w + cx];
+        cell = std::max(cell, batch);
+      }
+    }
+    queue.entries.emplace_back(batch, slot);
+  }
+
+  // まとまりごとに数えてから、z順を保ったまままとまり順に並べ替える
+  queue.batch_end.assign(queue.batch_tex.size(), 0);
+  for (const auto& entry : queue.entries) queue.batch_end[entry.first] += 1;
+  std::uint32_t total = 0;
+  for (auto& end : queue.batch_end) {
+    total += end;
+    end = total;
+  }
+  queue.slots.resize(queue.entries.size());
+  for (std::size_t i = queue.entries.size(); i-- > 0;) {
+    queue.slots[--queue.batch_end[queue.entries[i].first]] = queue.entries[i].second;
+  }
+  for (std::size_t b = 0; b < queue.batch_end.size(); b++) {
+    queue.batch_end[b] = b + 1 < queue.batch_end.size() ? queue.batch_end[b + 1] : queue.slots.size();
+  }
+}
+
+void render_images(SDL_Renderer* renderer, SpriteStore& sprites, RenderQueue& queue, SpriteBatch& batch) {
+  sort_sprites(sprites);
+  build_render_queue(queue, sprites);
+
+  std::size_t begin = 0;
+  for (std::size_t b = 0; b < queue.batch_tex.size(); b++) {
+    for (std::size_t i = begin; i < queue.batch_end[b]; i++) {
+      std::uint32_t slot = queue.slots[i];
+      push_sprite(batch, sprites.regions[slot], sprites.rects[slot]);
+    }
+    flush_batch(renderer, queue.batch_tex[b], batch);
+    begin = queue.batch_end[b];
+  }
+}
+
+void render_texts(SDL_Renderer* renderer, const TextStore& texts, const GlyphAtlas& atlas, SpriteBatch& batch) {
+  for (std::size_t slot = 0; slot < texts.strings.size(); slot++) {
+    const TextLayout& layout = atlas.layouts[texts.strings[slot]];
+    SDL_Point pos = texts.positions[slot];
+    for (std::size_t i = 0; i < layout.regions.size(); i++) {
+      SDL_Rect rect = layout.rects[i];
+      rect.x += pos.x;
+      rect.y += pos.y;
+      push_sprite(batch, layout.regions[i], rect);
+    }
+  }
+  flush_batch(renderer, atlas.tex, batch);
+}
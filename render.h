@@ -0,0 +1,88 @@
+// 画像と文字列の描画
+#ifndef RENDER_H
+#define RENDER_H
+
+#include "engine.h"                   // エンジン全体で使う型と定数
+#include "metrics.h"                  // 運用中の計測値
+
+// 表示する文字列の数に合わせて置き場を用意する
+void init_texts(TextStore& texts, std::size_t string_count);
+
+// 表示する画像の数(シンボルの数)に合わせてスプライトの置き場を用意する
+void init_sprites(SpriteStore& sprites, std::size_t symbol_count);
+
+// 2つの矩形が同じか
+inline bool same_rect(const SDL_Rect& a, const SDL_Rect& b) {
+  return a.x == b.x && a.y == b.y && a.w == b.w && a.h == b.h;
+}
+
+// 表示中の画像のスロットを書き換える(変わったところだけ)
+inline void update_sprite(SpriteStore& sprites, std::int32_t slot, const TextureRegion& region, const SDL_Rect& rect, std::int32_t z) {
+  if (sprites.regions[slot].tex != region.tex || !same_rect(sprites.regions[slot].src, region.src) ||
+      !same_rect(sprites.rects[slot], rect)) {
+    sprites.regions[slot] = region;
+    sprites.rects[slot] = rect;
+    sprites.changed = true;
+  }
+  if (sprites.z[slot] != z) {
+    sprites.z[slot] = z;
+    sprites.order_dirty = true;
+    sprites.changed = true;
+  }
+}
+
+// idの画像を表示する(表示していなければスロットを足す)。書いたスロットを返す
+std::int32_t set_sprite(SpriteStore& sprites, std::uint32_t id, const TextureRegion& region, const SDL_Rect& rect, std::int32_t z);
+
+// 描画順が変わっていればz順に並べ直す(スロットは表示した順に割り当てるので同じzなら表示した順になる)
+void sort_sprites(SpriteStore& sprites);
+
+// keyの場所に文字列を表示する(見た目が変わったらtrueを返す)
+// keyは普通は文字列プールのインデックスで、アクターの文字列を合成するときだけ別の値を使う
+bool set_text(TextStore& texts, std::uint32_t key, std::uint32_t string_index, SDL_Point pos);
+
+// ロード中の画面(進捗バー)を描画する
+void draw_loading_screen(SDL_Renderer* renderer, float progress);
+
+// 画面の表示を更新する
+inline void present_frame(SDL_Renderer* renderer) {
+  ENGINE_ZONE("present");
+  SDL_RenderPresent(renderer);
+  add_metric(METRIC_FRAMES, 1);
+  ENGINE_FRAME_MARK();
+}
+
+// 描画する四角形の頂点を溜めておくバッファ(毎フレーム使い回す)
+struct SpriteBatch {
+  std::vector<SDL_Vertex> vertices;
+  std::vector<int> indices;
+};
+
+// 画像1枚分の四角形をバッチに積む
+void push_sprite(SpriteBatch& batch, const TextureRegion& r, const SDL_Rect& rect);
+
+// 溜めた四角形をまとめて描画してバッファを空にする
+void flush_batch(SDL_Renderer* renderer, SDL_Texture* tex, SpriteBatch& batch);
+
+// 画面内の画像をテクスチャごとのまとまり(描画呼び出し1回分)に分けた描画キュー(毎フレーム使い回す)
+// 画面を格子に区切り、マスごとに最後にそこへ描いたまとまりを覚えておく
+struct RenderQueue {
+  int grid_w, grid_h;
+  std::vector<std::int32_t> cell_batch;               // マス→そこに描く最後のまとまり(-1なら無し)
+  std::unordered_map<SDL_Texture*, std::int32_t> latest; // テクスチャ→それを使う最後のまとまり
+  std::vector<SDL_Texture*> batch_tex;                // まとまり→テクスチャ
+  std::vector<std::uint32_t> batch_end;               // まとまり→slotsでの終わりの位置
+  std::vector<std::pair<std::uint32_t, std::uint32_t>> entries; // (まとまり, スロット)をz順に
+  std::vector<std::uint32_t> slots;                   // まとまり順に並べたスロット
+  std::size_t visible, culled;
+};
+
+// 表示中の画像を描画する
+// 画面外の画像は除き、見た目が変わらない範囲で同じテクスチャの画像を1回のSDL_RenderGeometryにまとめる
+void render_images(SDL_Renderer* renderer, SpriteStore& sprites, RenderQueue& queue, SpriteBatch& batch);
+
+// 表示中の文字列を画像の上に描画する
+// 文字は全て1枚のグリフアトラスにあるので、全ての文字列を1回のSDL_RenderGeometryで描ける
+void render_texts(SDL_Renderer* renderer, const TextStore& texts, const GlyphAtlas& atlas, SpriteBatch& batch);
+
+#endif // RENDER_H
@@ -0,0 +1,1090 @@
+#include "script.h"                   // スクリプトの解釈とコンパイル
+#include "vm.h"                       // コマンドとスクリプトの実行
+#include <fcntl.h>                    // コンパイル済みスクリプトのファイルを開きたい
+#include <sys/mman.h>                 // コンパイル済みスクリプトのファイルをmmapしたい
+#include <sys/stat.h>                 // ファイルの大きさを知りたい
+#include <unistd.h>                   // ファイルを閉じたい
+
+std::optional<std::string>
+load_txt(const std::string pathstr)
+{
+  std::ifstream ifs(pathstr, std::ios::binary | std::ios::ate);
+
+  if (!ifs)
+    return std::nullopt;
+
+  // 大きさを調べてから一度に読み込む
+  std::string data(static_cast<std::size_t>(ifs.tellg()), '\0');
+  ifs.seekg(0);
+  ifs.read(&data[0], data.size());
+
+  return data;
+}
+
+// スクリプトの字句の種類
+enum TokenType {
+  TOKEN_NUMBER,
+  TOKEN_STRING,
+  TOKEN_SYMBOL,
+};
+
+// スクリプトの字句(元の文字列を指すだけでコピーしない)
+struct Token {
+  TokenType type;
+  std::string_view text; // STRINGはダブルクォーテーションを除いた中身
+  double number;
+  std::uint32_t line;    // 1から数えた行番号
+  std::uint32_t column;  // 1から数えた行内の位置(バイト単位)
+};
+
+// スクリプト文字列を行ごとに、行をタブ区切りの字句ごとに読み進めるスキャナ
+// 行や字句を切り出してもコピーもメモリ確保もしない
+struct ScriptScanner {
+  std::string_view source;
+  std::size_t next_line_pos; // 次の行の先頭
+  std::uint32_t line;        // 現在の行番号
+  std::string_view current;  // 現在の行
+  std::size_t token_pos;     // 現在の行の中で次の字句を探す位置
+  bool error;                // 解釈できない字句があったか
+};
+
+// first_lineはsourceの先頭の行番号(スクリプトの途中から読むときに指定する)
+ScriptScanner make_scanner(std::string_view source, std::uint32_t first_line = 1) {
+  return ScriptScanner{source, 0, first_line - 1, std::string_view(), 0, false};
+}
+
+// 次の空でない行に進む(行が無くなったらfalse)
+bool next_line(ScriptScanner& sc) {
+  while (sc.next_line_pos < sc.source.size()) {
+    std::size_t end = sc.source.find('\n', sc.next_line_pos);
+    if (end == std::string_view::npos) end = sc.source.size();
+    sc.current = sc.source.substr(sc.next_line_pos, end - sc.next_line_pos);
+    sc.next_line_pos = end + 1;
+    sc.line += 1;
+    sc.token_pos = 0;
+    // 改行がCRLFのスクリプトも読めるようにする
+    if (!sc.current.empty() && sc.current.back() == '\r') sc.current.remove_suffix(1);
+    if (!sc.current.empty()) return true;
+  }
+  return false;
+}
+
+// 字句全体が数値なら解釈してtrueを返す(例外は使わない)
+// std::stodと同じく16進数(0x...)も読む。infやnanは数値にしない(シンボルとして扱う)
+bool scan_number(std::string_view text, double& value) {
+  const char* first = text.data();
+  const char* last = first + text.size();
+  bool negative = first != last && *first == '-';
+  if (first != last && (*first == '+' || *first == '-')) ++first;
+  std::chars_format format = std::chars_format::general;
+  if (last - first > 2 && first[0] == '0' && (first[1] == 'x' || first[1] == 'X')) {
+    first += 2;
+    format = std::chars_format::hex;
+  }
+  if (first == last || *first == '+' || *first == '-') return false;
+  auto result = std::from_chars(first, last, value, format);
+  if (result.ec != std::errc() || result.ptr != last || !std::isfinite(value)) return false;
+  if (negative) value = -value;
+  return true;
+}
+
+// 現在の行の次の字句を読む(字句が無くなったらfalse)
+// 解釈できない字句は行と位置を付けて報告し、読み飛ばす
+bool next_token(ScriptScanner& sc, Token& token) {
+  while (sc.token_pos <= sc.current.size()) {
+    std::size_t begin = sc.token_pos;
+    std::size_t end = sc.current.find('\t', begin);
+    if (end == std::string_view::npos) end = sc.current.size();
+    sc.token_pos = end + 1;
+    std::string_view text = sc.current.substr(begin, end - begin);
+    // タブが続いてできた空の字句は飛ばす
+    if (text.empty()) continue;
+
+    token.line = sc.line;
+    token.column = begin + 1;
+    if (scan_number(text, token.number)) {
+      token.type = TOKEN_NUMBER;
+      token.text = text;
+    } else if (text.front() == '\"') {
+      // ダブルクォーテーションで囲まれていれば文字列
+      if (text.size() < 2 || text.back() != '\"') {
+        std::cerr << "Unterminated string at line " << token.line << ", column " << token.column << std::endl;
+        sc.error = true;
+        continue;
+      }
+      token.type = TOKEN_STRING;
+      token.text = text.substr(1, text.size() - 2);
+    } else {
+      // 上記のいずれでも無い場合はシンボルとして解釈
+      token.type = TOKEN_SYMBOL;
+      token.text = text;
+    }
+    return true;
+  }
+  return false;
+}
+
+// 行頭の字句をコマンド名として解釈する(予約済みのコマンド名と一致しなければエラー出力してfalse)
+bool scan_command_name(ScriptScanner& sc, CommandName& name) {
+  Token token;
+  if (!next_token(sc, token)) return false;
+  auto found = COMMAND_MAP.find(token.text);
+  if (token.type != TOKEN_SYMBOL || found == COMMAND_MAP.end()) {
+    std::cerr << "Invalid command name: '" << token.text << "' at line " << token.line << std::endl;
+    sc.error = true;
+    return false;
+  }
+  name = found->second;
+  return true;
+}
+
+// パラメータ位置にある文字列を解釈してParameter型に変換
+Parameter parse_param(const std::string& source) {
+  double number;
+  if (scan_number(source, number)) return std::make_pair("NUMBER", source);
+  // ダブルクォーテーションで囲まれているかどうかで解釈を変える
+  if (source.size() >= 2 && source.front() == '\"' && source.back() == '\"') {
+    return std::make_pair("STRING", source.substr(1, source.size() - 2));
+  }
+  // 上記のいずれでも無い場合はシンボルとして解釈
+  return std::make_pair("SYMBOL", source);
+}
+
+std::vector<Command>
+parse(const std::string& source)
+{
+  std::vector<Command> result;
+  ScriptScanner sc = make_scanner(source);
+
+  // 行単位で処理(解釈できない行は無視する)
+  while (next_line(sc)) {
+    CommandName name;
+    if (!scan_command_name(sc, name)) continue;
+
+    std::vector<Parameter> parameters;
+    Token token;
+    while (next_token(sc, token)) {
+      const char* type = token.type == TOKEN_NUMBER ? "NUMBER" : token.type == TOKEN_STRING ? "STRING" : "SYMBOL";
+      parameters.emplace_back(type, std::string(token.text));
+    }
+
+    result.push_back(make_pair(name, parameters));
+  }
+
+  return result;
+}
+
+// 文字列をプールに登録してインデックスを返す(登録済みならそのインデックス)
+// (登録済みかどうかはstd::string_viewのまま調べるので、新しい文字列のときだけメモリを確保する)
+std::uint32_t
+intern(std::vector<std::string>& pool, std::map<std::string, std::uint32_t, std::less<>>& index, std::string_view str)
+{
+  auto found = index.find(str);
+  if (found != index.end()) return found->second;
+  std::uint32_t id = pool.size();
+  pool.emplace_back(str);
+  index.emplace(pool.back(), id);
+  return id;
+}
+
+// 位置posのオペランドが数値として読めるか(即値か変数)
+bool is_numeric_operand(const ProgramData& program, const Instruction& inst, std::uint32_t pos) {
+  OperandKind kind = program.operands[inst.operand_begin + pos].kind;
+  return kind == OPERAND_NUMBER || kind == OPERAND_SYMBOL;
+}
+
+// imageコマンドの引数をコンパイル時に検査する
+bool validate_image(const ProgramData& program, const Instruction& inst) {
+  const Operand* ops = &program.operands[inst.operand_begin];
+  if (inst.operand_count != 4 && inst.operand_count != 6 && inst.operand_count != 7) {
+    std::cerr << "'image' command should have 4, 6 or 7 arguments." << std::endl;
+    return false;
+  }
+  if (ops[0].kind != OPERAND_SYMBOL) {
+    std::cerr << "1st argument of 'image' command should be a symbol." << std::endl;
+    return false;
+  }
+  if (ops[1].kind != OPERAND_STRING) {
+    std::cerr << "2nd argument of 'image' command should be a string." << std::endl;
+    return false;
+  }
+  for (std::uint32_t i = 2; i < inst.operand_count; i++) {
+    if (!is_numeric_operand(program, inst, i)) {
+      std::cerr << "position, size and z of 'image' command should be numbers or variables." << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+// waitコマンドの引数をコンパイル時に検査する
+bool validate_wait(const ProgramData& program, const Instruction& inst) {
+  if (inst.operand_count > 1 || (inst.operand_count == 1 && !is_numeric_operand(program, inst, 0))) {
+    std::cerr << "'wait' command should have a number of frames or nothing." << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// spawnコマンドの引数をコンパイル時に検査する
+bool validate_spawn(const ProgramData& program, const Instruction& inst) {
+  if (inst.operand_count < 1 || inst.operand_count > 2 || program.operands[inst.operand_begin].kind != OPERAND_SYMBOL ||
+      (inst.operand_count == 2 && !is_numeric_operand(program, inst, 1))) {
+    std::cerr << "'spawn' command should have a label name and optionally a count." << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// textコマンドの引数をコンパイル時に検査する
+bool validate_text(const ProgramData& program, const Instruction& inst) {
+  if (inst.operand_count != 3) {
+    std::cerr << "'text' command should have 3 arguments." << std::endl;
+    return false;
+  }
+  if (program.operands[inst.operand_begin].kind != OPERAND_STRING) {
+    std::cerr << "1st argument of 'text' command should be a string." << std::endl;
+    return false;
+  }
+  if (!is_numeric_operand(program, inst, 1) || !is_numeric_operand(program, inst, 2)) {
+    std::cerr << "position of 'text' command should be numbers or variables." << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// 引数がシンボル1つだけのコマンド(labelとgoto)の引数をコンパイル時に検査する
+bool validate_label_operand(const ProgramData& program, const Instruction& inst, const char* name) {
+  if (inst.operand_count != 1 || program.operands[inst.operand_begin].kind != OPERAND_SYMBOL) {
+    std::cerr << "'" << name << "' command should have a label name." << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// コマンドの種類ごとに引数を検査する
+bool validate(const ProgramData& program, const Instruction& inst) {
+  switch (inst.op) {
+  case LABEL: return validate_label_operand(program, inst, "label");
+  case GOTO: return validate_label_operand(program, inst, "goto");
+  case IMAGE: return validate_image(program, inst);
+  case TEXT: return validate_text(program, inst);
+  case WAIT: return validate_wait(program, inst);
+  case SPAWN: return validate_spawn(program, inst);
+  default: return true;
+  }
+}
+
+int label_operand_position(const Instruction& inst) {
+  switch (inst.op) {
+  case GOTO: return 0;
+  case SPAWN: return 0;
+  case INPUT: return 1;
+  case IF: return inst.operand_count > 0 ? inst.operand_count - 1 : -1;
+  default: return -1;
+  }
+}
+
+// ラベルの位置を表にし、飛び先のシンボルを命令のインデックスに置き換える
+// 見つからないラベルはここで報告し、その命令は実行しても飛ばない
+bool resolve_labels(ProgramData& program) {
+  bool ok = true;
+  program.labels.assign(program.symbols.size(), -1);
+  for (std::size_t i = 0; i < program.code.size(); i++) {
+    const Instruction& inst = program.code[i];
+    if (inst.op != LABEL) continue;
+    std::uint32_t name = program.operands[inst.operand_begin].index;
+    if (program.labels[name] >= 0) {
+      std::cerr << "Duplicate label: '" << program.symbols[name] << "'" << std::endl;
+      ok = false;
+      continue;
+    }
+    program.labels[name] = i;
+  }
+
+  for (const auto& inst : program.code) {
+    int pos = label_operand_position(inst);
+    if (pos < 0) continue;
+    Operand& operand = program.operands[inst.operand_begin + pos];
+    if (operand.kind != OPERAND_SYMBOL) continue;
+    std::int32_t target = program.labels[operand.index];
+    if (target < 0) {
+      std::cerr << "Unknown label: '" << program.symbols[operand.index] << "'" << std::endl;
+      ok = false;
+      continue;
+    }
+    // ラベル命令自体は何もしないので、その次の命令に直接飛ぶ
+    operand.kind = OPERAND_LABEL;
+    operand.index = target + 1;
+  }
+  return ok;
+}
+
+// 式の中の演算子
+struct ExprOperator {
+  ExprOp op;
+  int precedence; // 大きいほど先に計算する
+};
+
+// 演算子の記号からExprOperatorを引く辞書
+const std::map<std::string, ExprOperator> EXPR_OPERATORS = {
+  {"||", {EXPR_OR, 1}},
+  {"&&", {EXPR_AND, 2}},
+  {"==", {EXPR_EQ, 3}},
+  {"!=", {EXPR_NE, 3}},
+  {"<", {EXPR_LT, 4}},
+  {">", {EXPR_GT, 4}},
+  {"<=", {EXPR_LE, 4}},
+  {">=", {EXPR_GE, 4}},
+  {"+", {EXPR_ADD, 5}},
+  {"-", {EXPR_SUB, 5}},
+  {"*", {EXPR_MUL, 6}},
+  {"/", {EXPR_DIV, 6}},
+  {"%", {EXPR_MOD, 6}},
+};
+// 単項のマイナスの優先順位
+const int EXPR_NEG_PRECEDENCE = 7;
+
+// 演算子を後置記法の命令列に出す
+// 計算に使う値が全て定数なら、その場で計算して定数1つに畳み込む
+void emit_operator(std::vector<ExprInstr>& out, ExprOp op) {
+  std::size_t n = out.size();
+  if (op == EXPR_NEG) {
+    if (n >= 1 && out[n - 1].op == EXPR_CONST) {
+      out[n - 1].value = -out[n - 1].value;
+      return;
+    }
+  } else if (n >= 2 && out[n - 1].op == EXPR_CONST && out[n - 2].op == EXPR_CONST) {
+    out[n - 2].value = apply_binary(op, out[n - 2].value, out[n - 1].value);
+    out.pop_back();
+    return;
+  }
+  out.push_back(ExprInstr{op, 0, 0.0});
+}
+
+// 字句に区切られた中置記法の式を後置記法の命令列にコンパイルする(操車場アルゴリズム)
+// 成功したらprogram.expressionsに加え、そのインデックスを返す(失敗したら-1)
+std::int32_t compile_expression(ProgramData& program, const std::vector<Operand>& tokens) {
+  // 演算子のスタックの要素。括弧はop_precedenceを0とする
+  struct Pending {
+    ExprOp op;
+    int precedence;
+  };
+  std::vector<Pending> pending;
+  std::vector<ExprInstr> out;
+  bool expect_value = true; // 次に値(または単項演算子・開き括弧)が来るはずか
+
+  auto pop_until = [&](int precedence) {
+    while (!pending.empty() && pending.back().precedence >= precedence && pending.back().precedence > 0) {
+      emit_operator(out, pending.back().op);
+      pending.pop_back();
+    }
+  };
+
+  for (const auto& token : tokens) {
+    if (token.kind == OPERAND_NUMBER) {
+      if (!expect_value) return -1;
+      out.push_back(ExprInstr{EXPR_CONST, 0, token.number});
+      expect_value = false;
+      continue;
+    }
+    if (token.kind != OPERAND_SYMBOL) return -1;
+
+    const std::string& name = program.symbols[token.index];
+    if (name == "(") {
+      if (!expect_value) return -1;
+      pending.push_back(Pending{EXPR_CONST, 0});
+    } else if (name == ")") {
+      if (expect_value) return -1;
+      pop_until(1);
+      if (pending.empty()) return -1;
+      pending.pop_back();
+    } else if (EXPR_OPERATORS.count(name)) {
+      if (expect_value) {
+        // 値の位置にある'-'は単項のマイナス
+        if (name != "-") return -1;
+        pending.push_back(Pending{EXPR_NEG, EXPR_NEG_PRECEDENCE});
+        continue;
+      }
+      const ExprOperator& oper = EXPR_OPERATORS.at(name);
+      pop_until(oper.precedence);
+      pending.push_back(Pending{oper.op, oper.precedence});
+      expect_value = true;
+    } else {
+      if (!expect_value) return -1;
+      out.push_back(ExprInstr{EXPR_LOAD, token.index, 0.0});
+      expect_value = false;
+    }
+  }
+  if (expect_value) return -1;
+  while (!pending.empty()) {
+    if (pending.back().precedence == 0) return -1; // 閉じていない括弧
+    emit_operator(out, pending.back().op);
+    pending.pop_back();
+  }
+
+  // 評価時のスタックが上限に収まるか確かめる
+  int depth = 0, max_depth = 0;
+  for (const auto& instr : out) {
+    if (instr.op == EXPR_CONST || instr.op == EXPR_LOAD) depth += 1;
+    else if (instr.op != EXPR_NEG) depth -= 1;
+    max_depth = std::max(max_depth, depth);
+  }
+  if (max_depth > static_cast<int>(EXPR_STACK_SIZE)) return -1;
+
+  Expression expr{static_cast<std::uint32_t>(program.expr_code.size()), static_cast<std::uint32_t>(out.size())};
+  program.expr_code.insert(program.expr_code.end(), out.begin(), out.end());
+  program.expressions.push_back(expr);
+  return program.expressions.size() - 1;
+}
+
+// inputコマンドのモード名でInputModeを引ける辞書
+const std::map<std::string, InputMode> INPUT_MODE_MAP = {
+  {"held", INPUT_HELD},
+  {"down", INPUT_PRESSED},
+  {"up", INPUT_RELEASED},
+};
+
+// SDLのキー名とは別に、スクリプトで使える記号のキー名
+const std::map<std::string, SDL_Scancode> KEY_NAME_MAP = {
+  {" ", SDL_SCANCODE_SPACE},
+  {"←", SDL_SCANCODE_LEFT},
+  {"→", SDL_SCANCODE_RIGHT},
+  {"↑", SDL_SCANCODE_UP},
+  {"↓", SDL_SCANCODE_DOWN},
+};
+
+// inputコマンドのキー名をスキャンコードに、モード名をInputModeに置き換える
+// input "キー" ラベル [held|down|up]  →  [スキャンコード, ラベル, モード]
+bool lower_input_operands(ProgramData& program, Instruction& inst) {
+  Operand* ops = &program.operands[inst.operand_begin];
+  if (inst.operand_count < 2 || inst.operand_count > 3 ||
+      ops[0].kind != OPERAND_STRING || ops[1].kind != OPERAND_SYMBOL ||
+      (inst.operand_count == 3 && ops[2].kind != OPERAND_SYMBOL)) {
+    std::cerr << "'input' command should have a key name, a label name and optionally held/down/up." << std::endl;
+    return false;
+  }
+
+  const std::string& key = program.strings[ops[0].index];
+  SDL_Scancode code = KEY_NAME_MAP.count(key) ? KEY_NAME_MAP.at(key) : SDL_GetScancodeFromName(key.c_str());
+  if (code == SDL_SCANCODE_UNKNOWN) {
+    std::cerr << "'input': unknown key name '" << key << "'" << std::endl;
+    return false;
+  }
+  InputMode mode = INPUT_HELD;
+  if (inst.operand_count == 3) {
+    const std::string& mode_name = program.symbols[ops[2].index];
+    if (!INPUT_MODE_MAP.count(mode_name)) {
+      std::cerr << "'input': unknown mode '" << mode_name << "'" << std::endl;
+      return false;
+    }
+    mode = INPUT_MODE_MAP.at(mode_name);
+    program.operands.pop_back();
+  }
+
+  ops[0] = Operand{OPERAND_NUMBER, 0, static_cast<double>(code)};
+  Operand mode_operand{OPERAND_NUMBER, 0, static_cast<double>(mode)};
+  program.operands.push_back(mode_operand);
+  inst.operand_count = 3;
+  return true;
+}
+
+// setとifの引数にある式をコンパイルし、引数を式1つ(と変数名や飛び先)に置き換える
+// set 変数 式  →  [変数, 式]
+// if 式 ラベル →  [式, ラベル]
+bool lower_expression_operands(ProgramData& program, Instruction& inst) {
+  const char* name = inst.op == SET ? "set" : "if";
+  if (inst.operand_count < 2) {
+    std::cerr << "'" << name << "' command should have an expression." << std::endl;
+    return false;
+  }
+  Operand* ops = &program.operands[inst.operand_begin];
+  Operand head = ops[0];
+  Operand tail = ops[inst.operand_count - 1];
+  if ((inst.op == SET && head.kind != OPERAND_SYMBOL) || (inst.op == IF && tail.kind != OPERAND_SYMBOL)) {
+    std::cerr << "'" << name << "' command should have " << (inst.op == SET ? "a variable name." : "a label name.") << std::endl;
+    return false;
+  }
+
+  std::vector<Operand> tokens = inst.op == SET
+    ? std::vector<Operand>(ops + 1, ops + inst.operand_count)
+    : std::vector<Operand>(ops, ops + inst.operand_count - 1);
+  std::int32_t expr = compile_expression(program, tokens);
+  if (expr < 0) {
+    std::cerr << "Invalid expression in '" << name << "' command." << std::endl;
+    return false;
+  }
+
+  Operand compiled{};
+  compiled.kind = OPERAND_EXPR;
+  compiled.index = expr;
+  program.operands.resize(inst.operand_begin);
+  if (inst.op == SET) {
+    program.operands.push_back(head);
+    program.operands.push_back(compiled);
+  } else {
+    program.operands.push_back(compiled);
+    program.operands.push_back(tail);
+  }
+  inst.operand_count = 2;
+  return true;
+}
+
+// 配列をアリーナに写す
+template <typename T>
+ArrayView<T> arena_copy(Arena& arena, const std::vector<T>& v) {
+  T* ptr = arena_alloc<T>(arena, v.size());
+  if (ptr != NULL && !v.empty()) std::memcpy(ptr, v.data(), sizeof(T) * v.size());
+  return ArrayView<T>{ptr, v.size()};
+}
+
+// 文字列プールをNUL終端して詰めた形でアリーナに写す
+StringTable arena_pack_strings(Arena& arena, const std::vector<std::string>& pool) {
+  std::uint32_t* offsets = arena_alloc<std::uint32_t>(arena, pool.size() + 1);
+  std::size_t total = 0;
+  for (const auto& str : pool) total += str.size() + 1;
+  char* chars = arena_alloc<char>(arena, total);
+  if (arena.base != NULL) {
+    std::size_t pos = 0;
+    for (std::size_t i = 0; i < pool.size(); i++) {
+      offsets[i] = pos;
+      std::memcpy(chars + pos, pool[i].data(), pool[i].size());
+      pos += pool[i].size();
+      chars[pos++] = '\0';
+    }
+    offsets[pool.size()] = pos;
+  }
+  return StringTable{ArrayView<std::uint32_t>{offsets, pool.size() + 1}, chars};
+}
+
+// ProgramDataの全ての配列をアリーナに並べ、Programのビューをそこに向ける
+Program layout_program(Arena& arena, const ProgramData& data) {
+  Program program;
+  program.code = arena_copy(arena, data.code);
+  program.operands = arena_copy(arena, data.operands);
+  program.strings = arena_pack_strings(arena, data.strings);
+  program.symbols = arena_pack_strings(arena, data.symbols);
+  program.labels = arena_copy(arena, data.labels);
+  program.expr_code = arena_copy(arena, data.expr_code);
+  program.expressions = arena_copy(arena, data.expressions);
+  return program;
+}
+
+// コンパイルし終えたProgramDataを実行用のProgramにする
+// 中身は1回だけ確保した連続した領域に詰め直すので、命令と引数が近くに並び、解放も1回で済む
+Program finalize_program(ProgramData&& data) {
+  Arena measure{NULL, 0, 0};
+  layout_program(measure, data);
+
+  std::shared_ptr<unsigned char> storage(new unsigned char[std::max<std::size_t>(measure.used, 1)],
+                                         std::default_delete<unsigned char[]>());
+  Arena arena{storage.get(), measure.used, 0};
+  Program program = layout_program(arena, data);
+  program.storage = storage;
+  return program;
+}
+
+// 字句を1つオペランドにして加える
+// 数値は解釈済みの値を、文字列とシンボルはプールのインデックスを持たせる
+void add_operand(Compiler& compiler, TokenType type, std::string_view text, double number) {
+  Operand operand{};
+  if (type == TOKEN_NUMBER) {
+    operand.kind = OPERAND_NUMBER;
+    operand.number = number;
+  } else if (type == TOKEN_STRING) {
+    operand.kind = OPERAND_STRING;
+    operand.index = intern(compiler.program.strings, compiler.string_index, text);
+  } else {
+    operand.kind = OPERAND_SYMBOL;
+    operand.index = intern(compiler.program.symbols, compiler.symbol_index, text);
+  }
+  compiler.program.operands.push_back(operand);
+}
+
+// operand_begin以降に加えたオペランドで命令を完成させる
+// 引数が不正なコマンドは実行時に調べなくて済むようここで取り除いてfalseを返す
+bool add_instruction(Compiler& compiler, CommandName op, std::uint32_t operand_begin) {
+  ProgramData& program = compiler.program;
+  Instruction inst;
+  inst.op = op;
+  inst.operand_begin = operand_begin;
+  inst.operand_count = program.operands.size() - operand_begin;
+
+  bool ok = true;
+  // setとifの式、inputのキー名はここで一度だけコンパイルする
+  if (inst.op == SET || inst.op == IF) ok = lower_expression_operands(program, inst);
+  else if (inst.op == INPUT) ok = lower_input_operands(program, inst);
+  if (ok) ok = validate(program, inst);
+
+  if (!ok) {
+    program.operands.resize(inst.operand_begin);
+    return false;
+  }
+  program.code.push_back(inst);
+  return true;
+}
+
+Program
+compile(const std::vector<Command>& commands)
+{
+  Compiler compiler;
+
+  for (const auto& cmd : commands) {
+    std::uint32_t operand_begin = compiler.program.operands.size();
+    for (const auto& param : std::get<1>(cmd)) {
+      const std::string& type = std::get<0>(param);
+      double number = 0.0;
+      if (type == "NUMBER") {
+        scan_number(std::get<1>(param), number);
+        add_operand(compiler, TOKEN_NUMBER, std::get<1>(param), number);
+      } else {
+        add_operand(compiler, type == "STRING" ? TOKEN_STRING : TOKEN_SYMBOL, std::get<1>(param), number);
+      }
+    }
+    add_instruction(compiler, std::get<0>(cmd), operand_begin);
+  }
+
+  resolve_labels(compiler.program);
+  return finalize_program(std::move(compiler.program));
+}
+
+// スクリプト文字列を1回の走査でバイトコードにしてcompilerに加える(コマンド列は作らない)
+// 不正な行は行番号を付けて報告し、その行は無視する
+void compile_lines(Compiler& compiler, std::string_view source, std::uint32_t first_line) {
+  ScriptScanner sc = make_scanner(source, first_line);
+
+  while (next_line(sc)) {
+    CommandName name;
+    if (!scan_command_name(sc, name)) continue;
+
+    std::uint32_t operand_begin = compiler.program.operands.size();
+    Token token;
+    while (next_token(sc, token)) {
+      add_operand(compiler, token.type, token.text, token.number);
+    }
+    if (!add_instruction(compiler, name, operand_begin)) {
+      std::cerr << "  at line " << sc.line << std::endl;
+    }
+  }
+}
+
+Program
+compile_source(std::string_view source)
+{
+  ENGINE_ZONE("parse");
+  Compiler compiler;
+  compile_lines(compiler, source, 1);
+  resolve_labels(compiler.program);
+  return finalize_program(std::move(compiler.program));
+}
+
+// ---- ホットリロード用の差分コンパイル ----
+
+// 最初のラベルより前の部分のブロックのラベル
+const std::uint32_t NO_LABEL = UINT32_MAX;
+
+// 行の最初の字句がlabelか
+bool is_label_line(std::string_view line) {
+  std::size_t begin = line.find_first_not_of('\t');
+  if (begin == std::string_view::npos) return false;
+  std::size_t end = line.find('\t', begin);
+  std::string_view head = line.substr(begin, end == std::string_view::npos ? std::string_view::npos : end - begin);
+  if (!head.empty() && head.back() == '\r') head.remove_suffix(1);
+  return head == "label";
+}
+
+// スクリプトをlabel行の手前で区切る(各ブロックの文字列と先頭の行番号)
+std::vector<std::pair<std::string_view, std::uint32_t>> split_blocks(std::string_view source) {
+  std::vector<std::pair<std::string_view, std::uint32_t>> blocks;
+  std::size_t block_begin = 0;
+  std::uint32_t block_line = 1;
+  std::uint32_t line = 1;
+  for (std::size_t pos = 0; pos < source.size(); line++) {
+    std::size_t end = source.find('\n', pos);
+    if (end == std::string_view::npos) end = source.size();
+    if (pos > block_begin && is_label_line(source.substr(pos, end - pos))) {
+      blocks.emplace_back(source.substr(block_begin, pos - block_begin), block_line);
+      block_begin = pos;
+      block_line = line;
+    }
+    pos = end + 1;
+  }
+  if (block_begin < source.size()) blocks.emplace_back(source.substr(block_begin), block_line);
+  return blocks;
+}
+
+// 1ブロックをプールを共有したままコンパイルする
+ScriptBlock compile_block(ScriptCache& cache, std::string_view source, std::uint32_t first_line) {
+  ProgramData& program = cache.compiler.program;
+  program.code.clear();
+  program.operands.clear();
+  program.expr_code.clear();
+  program.expressions.clear();
+  compile_lines(cache.compiler, source, first_line);
+
+  ScriptBlock block;
+  block.source = std::string(source);
+  block.data.code = std::move(program.code);
+  block.data.operands = std::move(program.operands);
+  block.data.expr_code = std::move(program.expr_code);
+  block.data.expressions = std::move(program.expressions);
+  const auto& code = block.data.code;
+  block.label = !code.empty() && code[0].op == LABEL ? block.data.operands[code[0].operand_begin].index : NO_LABEL;
+  block.start = 0;
+  return block;
+}
+
+// ブロックを順に繋げ、ラベルを解決して実行用のProgramにする
+Program link_blocks(ScriptCache& cache) {
+  ProgramData program;
+  program.strings = cache.compiler.program.strings;
+  program.symbols = cache.compiler.program.symbols;
+  for (auto& block : cache.blocks) {
+    block.start = program.code.size();
+    std::uint32_t operand_offset = program.operands.size();
+    std::uint32_t expr_offset = program.expressions.size();
+    std::uint32_t expr_code_offset = program.expr_code.size();
+    for (Instruction inst : block.data.code) {
+      inst.operand_begin += operand_offset;
+      program.code.push_back(inst);
+    }
+    for (Operand operand : block.data.operands) {
+      if (operand.kind == OPERAND_EXPR) operand.index += expr_offset;
+      program.operands.push_back(operand);
+    }
+    for (Expression expr : block.data.expressions) {
+      expr.begin += expr_code_offset;
+      program.expressions.push_back(expr);
+    }
+    program.expr_code.insert(program.expr_code.end(), block.data.expr_code.begin(), block.data.expr_code.end());
+  }
+  cache.code_size = program.code.size();
+  resolve_labels(program);
+  return finalize_program(std::move(program));
+}
+
+Program update_script(ScriptCache& cache, std::string_view source, std::vector<std::uint32_t>& position_map) {
+  std::vector<ScriptBlock> old_blocks = std::move(cache.blocks);
+  std::size_t old_size = old_blocks.empty() ? 0 : cache.code_size;
+  std::multimap<std::string_view, std::size_t> old_by_source;
+  for (std::size_t i = 0; i < old_blocks.size(); i++) old_by_source.emplace(old_blocks[i].source, i);
+
+  // 変わっていないブロックはそのまま使い、どの古いブロックを使ったか覚えておく
+  std::vector<std::int32_t> reused_as(old_blocks.size(), -1);
+  std::vector<std::uint32_t> old_start(old_blocks.size());
+  for (std::size_t i = 0; i < old_blocks.size(); i++) old_start[i] = old_blocks[i].start;
+  std::size_t compiled = 0;
+  cache.blocks.clear();
+  for (const auto& piece : split_blocks(source)) {
+    auto found = old_by_source.find(piece.first);
+    if (found != old_by_source.end()) {
+      reused_as[found->second] = cache.blocks.size();
+      cache.blocks.push_back(std::move(old_blocks[found->second]));
+      old_by_source.erase(found);
+    } else {
+      cache.blocks.push_back(compile_block(cache, piece.first, piece.second));
+      compiled += 1;
+    }
+  }
+  Program program = link_blocks(cache);
+
+  std::map<std::uint32_t, std::uint32_t> label_start;
+  for (const auto& block : cache.blocks) label_start.emplace(block.label, block.start);
+  position_map.assign(old_size + 1, 0);
+  for (std::size_t i = 0; i < old_blocks.size(); i++) {
+    std::size_t begin = old_start[i];
+    std::size_t end = i + 1 < old_blocks.size() ? old_start[i + 1] : old_size;
+    std::uint32_t fallback = 0;
+    if (reused_as[i] < 0) {
+      auto found = label_start.find(old_blocks[i].label);
+      if (found != label_start.end()) fallback = found->second;
+    }
+    for (std::size_t pos = begin; pos < end; pos++) {
+      position_map[pos] = reused_as[i] >= 0 ? cache.blocks[reused_as[i]].start + (pos - begin) : fallback;
+    }
+  }
+  position_map[old_size] = program.code.size();
+
+  if (old_size > 0) {
+    std::cout << "script reloaded: " << compiled << " of " << cache.blocks.size() << " blocks recompiled." << std::endl;
+  }
+  return program;
+}
+
+// ---- コンパイル済みスクリプトのファイル ----
+// ヘッダの後に各配列をそのままの形で8バイト境界に並べる
+// 読み込むときはmmapしたメモリをそのままProgramの配列として使う
+
+const char PROGRAM_FILE_MAGIC[4] = {'E', 'G', 'E', 'P'};
+const std::uint32_t PROGRAM_FILE_VERSION = 2;
+
+// ファイル中の配列の位置
+enum ProgramSection {
+  SECTION_CODE,
+  SECTION_OPERANDS,
+  SECTION_LABELS,
+  SECTION_EXPR_CODE,
+  SECTION_EXPRESSIONS,
+  SECTION_STRING_OFFSETS,
+  SECTION_STRING_CHARS,
+  SECTION_SYMBOL_OFFSETS,
+  SECTION_SYMBOL_CHARS,
+  SECTION_COUNT,
+};
+
+struct ProgramFileSection {
+  std::uint64_t offset; // ファイル先頭からの位置
+  std::uint64_t count;  // 要素数
+};
+
+struct ProgramFileHeader {
+  char magic[4];
+  std::uint32_t version;
+  // 書き出したときの構造体の大きさとバイト順(違う環境で書き出したファイルを弾く)
+  std::uint32_t byte_order;
+  std::uint16_t instruction_size, operand_size, expr_instr_size, expression_size;
+  ProgramFileSection sections[SECTION_COUNT];
+};
+
+void dump_program(const Program& program) {
+  for (std::size_t i = 0; i < program.code.size(); i++) {
+    const Instruction& inst = program.code[i];
+    std::cout << i << ": " << inst.op << ":";
+    for (std::uint32_t j = 0; j < inst.operand_count; j++) {
+      const Operand& operand = program.operands[inst.operand_begin + j];
+      switch (operand.kind) {
+      case OPERAND_NUMBER: std::cout << " <NUMBER>" << operand.number; break;
+      case OPERAND_STRING: std::cout << " <STRING>" << program.strings[operand.index]; break;
+      case OPERAND_SYMBOL: std::cout << " <SYMBOL>" << program.symbols[operand.index]; break;
+      case OPERAND_LABEL: std::cout << " <LABEL>" << operand.index; break;
+      case OPERAND_EXPR: std::cout << " <EXPR>" << operand.index; break;
+      }
+    }
+    std::cout << std::endl;
+  }
+}
+
+// この環境でのヘッダの値
+ProgramFileHeader make_program_file_header() {
+  ProgramFileHeader header{};
+  std::memcpy(header.magic, PROGRAM_FILE_MAGIC, sizeof(header.magic));
+  header.version = PROGRAM_FILE_VERSION;
+  header.byte_order = 0x01020304;
+  header.instruction_size = sizeof(Instruction);
+  header.operand_size = sizeof(Operand);
+  header.expr_instr_size = sizeof(ExprInstr);
+  header.expression_size = sizeof(Expression);
+  return header;
+}
+
+bool save_program(const Program& program, const std::string& path) {
+  ProgramFileHeader header = make_program_file_header();
+  const void* data[SECTION_COUNT] = {
+    program.code.data(), program.operands.data(), program.labels.data(),
+    program.expr_code.data(), program.expressions.data(),
+    program.strings.offsets.data(), program.strings.chars,
+    program.symbols.offsets.data(), program.symbols.chars,
+  };
+  const std::size_t counts[SECTION_COUNT] = {
+    program.code.size(), program.operands.size(), program.labels.size(),
+    program.expr_code.size(), program.expressions.size(),
+    program.strings.offsets.size(), program.strings.offsets[program.strings.size()],
+    program.symbols.offsets.size(), program.symbols.offsets[program.symbols.size()],
+  };
+  const std::size_t sizes[SECTION_COUNT] = {
+    sizeof(Instruction), sizeof(Operand), sizeof(std::int32_t),
+    sizeof(ExprInstr), sizeof(Expression),
+    sizeof(std::uint32_t), sizeof(char), sizeof(std::uint32_t), sizeof(char),
+  };
+
+  std::uint64_t offset = sizeof(header);
+  for (int i = 0; i < SECTION_COUNT; i++) {
+    offset = (offset + 7) & ~static_cast<std::uint64_t>(7);
+    header.sections[i] = ProgramFileSection{offset, counts[i]};
+    offset += counts[i] * sizes[i];
+  }
+
+  std::ofstream ofs(path, std::ios::binary);
+  if (!ofs) return false;
+  ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  std::uint64_t written = sizeof(header);
+  for (int i = 0; i < SECTION_COUNT; i++) {
+    static const char zeros[8] = {};
+    ofs.write(zeros, header.sections[i].offset - written);
+    ofs.write(static_cast<const char*>(data[i]), counts[i] * sizes[i]);
+    written = header.sections[i].offset + counts[i] * sizes[i];
+  }
+  return static_cast<bool>(ofs);
+}
+
+// ファイル中の配列を指すビューを作る(ファイルの範囲に収まらなければfalse)
+template <typename T>
+bool map_section(const char* base, std::size_t file_size, const ProgramFileSection& section, ArrayView<T>& view) {
+  if (section.offset % alignof(T) != 0 || section.offset > file_size ||
+      section.count > (file_size - section.offset) / sizeof(T)) {
+    return false;
+  }
+  view = ArrayView<T>{reinterpret_cast<const T*>(base + section.offset), static_cast<std::size_t>(section.count)};
+  return true;
+}
+
+// 文字列プールのビューを作り、各文字列が範囲内でNUL終端しているか確かめる
+bool map_strings(const char* base, std::size_t file_size, const ProgramFileSection& offsets,
+                 const ProgramFileSection& chars, StringTable& table) {
+  ArrayView<char> char_view;
+  if (!map_section(base, file_size, offsets, table.offsets) || !map_section(base, file_size, chars, char_view)) {
+    return false;
+  }
+  if (table.offsets.empty() || table.offsets[table.offsets.size() - 1] != char_view.size()) return false;
+  for (std::size_t i = 0; i + 1 < table.offsets.size(); i++) {
+    if (table.offsets[i] >= table.offsets[i + 1] || char_view[table.offsets[i + 1] - 1] != '\0') return false;
+  }
+  table.chars = char_view.data();
+  return true;
+}
+
+// 読み込んだプログラムのオペランドの種類を数値として読めるか(即値か変数)
+bool is_numeric_kind(OperandKind kind) {
+  return kind == OPERAND_NUMBER || kind == OPERAND_SYMBOL;
+}
+
+// 飛び先のオペランドか(見つからなかったラベルはシンボルのまま残り、実行しても飛ばない)
+bool is_label_kind(OperandKind kind) {
+  return kind == OPERAND_LABEL || kind == OPERAND_SYMBOL;
+}
+
+// 命令の引数の数と種類がコンパイラの検査と下ごしらえの後の形になっているか確かめる
+bool check_operands(const Program& program, const Instruction& inst) {
+  const Operand* ops = program.operands.data() + inst.operand_begin;
+  std::uint32_t count = inst.operand_count;
+  switch (inst.op) {
+  case LABEL: return count == 1 && ops[0].kind == OPERAND_SYMBOL;
+  case GOTO: return count == 1 && is_label_kind(ops[0].kind);
+  case IMAGE:
+    if (count != 4 && count != 6 && count != 7) return false;
+    if (ops[0].kind != OPERAND_SYMBOL || ops[1].kind != OPERAND_STRING) return false;
+    for (std::uint32_t i = 2; i < count; i++) {
+      if (!is_numeric_kind(ops[i].kind)) return false;
+    }
+    return true;
+  case TEXT:
+    return count == 3 && ops[0].kind == OPERAND_STRING && is_numeric_kind(ops[1].kind) && is_numeric_kind(ops[2].kind);
+  case WAIT: return count == 0 || (count == 1 && is_numeric_kind(ops[0].kind));
+  case SPAWN:
+    return (count == 1 || count == 2) && is_label_kind(ops[0].kind) && (count == 1 || is_numeric_kind(ops[1].kind));
+  case SET: return count == 2 && ops[0].kind == OPERAND_SYMBOL && ops[1].kind == OPERAND_EXPR;
+  case IF: return count == 2 && ops[0].kind == OPERAND_EXPR && is_label_kind(ops[1].kind);
+  case INPUT:
+    // [スキャンコード, ラベル, モード]
+    return count == 3 && ops[0].kind == OPERAND_NUMBER && ops[0].number >= 0.0 && ops[0].number < SDL_NUM_SCANCODES &&
+           is_label_kind(ops[1].kind) && ops[2].kind == OPERAND_NUMBER &&
+           ops[2].number >= INPUT_HELD && ops[2].number <= INPUT_RELEASED;
+  default: return true;
+  }
+}
+
+// 式の命令列をスタックの深さだけ追って実行し、eval_expressionが範囲外を読み書きしないか確かめる
+bool check_expression(const Program& program, const Expression& expr) {
+  std::uint32_t depth = 0;
+  for (std::uint32_t i = 0; i < expr.count; i++) {
+    const ExprInstr& instr = program.expr_code[expr.begin + i];
+    switch (instr.op) {
+    case EXPR_LOAD:
+      if (instr.slot >= program.symbols.size()) return false;
+      // fallthrough
+    case EXPR_CONST:
+      if (depth >= EXPR_STACK_SIZE) return false;
+      depth++;
+      break;
+    case EXPR_NEG:
+      if (depth < 1) return false;
+      break;
+    default:
+      if (instr.op > EXPR_OR || depth < 2) return false;
+      depth--;
+      break;
+    }
+  }
+  return depth == 1;
+}
+
+// 命令とオペランドが配列の範囲を指し、コンパイラが出す形になっているか確かめる(壊れたファイルで実行時に落ちないように)
+bool check_program(const Program& program) {
+  if (program.labels.size() != program.symbols.size()) return false;
+  for (const auto& operand : program.operands) {
+    switch (operand.kind) {
+    case OPERAND_NUMBER: break;
+    case OPERAND_STRING: if (operand.index >= program.strings.size()) return false; break;
+    case OPERAND_SYMBOL: if (operand.index >= program.symbols.size()) return false; break;
+    case OPERAND_LABEL: if (operand.index > program.code.size()) return false; break;
+    case OPERAND_EXPR: if (operand.index >= program.expressions.size()) return false; break;
+    default: return false;
+    }
+  }
+  for (const auto& inst : program.code) {
+    if (inst.op < 0 || inst.op >= REGISTERED_COMMAND_COUNT || inst.operand_begin > program.operands.size() ||
+        inst.operand_count > program.operands.size() - inst.operand_begin || !check_operands(program, inst)) {
+      return false;
+    }
+  }
+  for (const auto& expr : program.expressions) {
+    if (expr.begin > program.expr_code.size() || expr.count > program.expr_code.size() - expr.begin ||
+        !check_expression(program, expr)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+std::optional<Program>
+load_program(const std::string& path)
+{
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) return std::nullopt;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || static_cast<std::size_t>(st.st_size) < sizeof(ProgramFileHeader)) {
+    close(fd);
+    return std::nullopt;
+  }
+  std::size_t size = st.st_size;
+  void* addr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) return std::nullopt;
+
+  Program program;
+  program.storage = std::shared_ptr<const void>(addr, [size](const void* p) { munmap(const_cast<void*>(p), size); });
+
+  const char* base = static_cast<const char*>(addr);
+  ProgramFileHeader header;
+  std::memcpy(&header, base, sizeof(header));
+  ProgramFileHeader expected = make_program_file_header();
+  if (std::memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0 || header.version != expected.version ||
+      header.byte_order != expected.byte_order || header.instruction_size != expected.instruction_size ||
+      header.operand_size != expected.operand_size || header.expr_instr_size != expected.expr_instr_size ||
+      header.expression_size != expected.expression_size) {
+    std::cerr << path << ": not a compiled script for this version of the engine." << std::endl;
+    return std::nullopt;
+  }
+
+  const ProgramFileSection* sec = header.sections;
+  bool ok = map_section(base, size, sec[SECTION_CODE], program.code) &&
+            map_section(base, size, sec[SECTION_OPERANDS], program.operands) &&
+            map_section(base, size, sec[SECTION_LABELS], program.labels) &&
+            map_section(base, size, sec[SECTION_EXPR_CODE], program.expr_code) &&
+            map_section(base, size, sec[SECTION_EXPRESSIONS], program.expressions) &&
+            map_strings(base, size, sec[SECTION_STRING_OFFSETS], sec[SECTION_STRING_CHARS], program.strings) &&
+            map_strings(base, size, sec[SECTION_SYMBOL_OFFSETS], sec[SECTION_SYMBOL_CHARS], program.symbols) &&
+            check_program(program);
+  if (!ok) {
+    std::cerr << path << ": compiled script is broken." << std::endl;
+    return std::nullopt;
+  }
+  return program;
+}
+
+const char* command_name(CommandName op) {
+  for (const auto& entry : COMMAND_MAP) {
+    if (entry.second == op) return entry.first.c_str();
+  }
+  return "?";
+}
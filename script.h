@@ -0,0 +1,94 @@
+// スクリプトの解釈とコンパイル
+#ifndef SCRIPT_H
+#define SCRIPT_H
+
+#include "engine.h"                   // エンジン全体で使う型と定数
+
+// ファイルから文字列を読み込む
+std::optional<std::string> load_txt(const std::string pathstr);
+
+// スクリプト文字列を解釈してコマンド列に変換
+// 実行にはcompile_sourceで直接バイトコードにする方が速い(こちらはベンチマークでの比較用)
+std::vector<Command> parse(const std::string& source);
+
+// 飛び先としてラベル名を取るオペランドの位置(無ければ-1)
+// gotoは第1引数、inputは第2引数、ifは最後の引数が飛び先
+int label_operand_position(const Instruction& inst);
+
+// 二項演算を計算する
+inline double apply_binary(ExprOp op, double a, double b) {
+  switch (op) {
+  case EXPR_ADD: return a + b;
+  case EXPR_SUB: return a - b;
+  case EXPR_MUL: return a * b;
+  case EXPR_DIV: return a / b;
+  case EXPR_MOD: return std::fmod(a, b);
+  case EXPR_LT: return a < b;
+  case EXPR_GT: return a > b;
+  case EXPR_LE: return a <= b;
+  case EXPR_GE: return a >= b;
+  case EXPR_EQ: return a == b;
+  case EXPR_NE: return a != b;
+  case EXPR_AND: return a != 0.0 && b != 0.0;
+  case EXPR_OR: return a != 0.0 || b != 0.0;
+  default: return 0.0;
+  }
+}
+
+// inputコマンドがキーの何を調べるか
+enum InputMode {
+  INPUT_HELD,     // 押されている間
+  INPUT_PRESSED,  // 押された瞬間
+  INPUT_RELEASED, // 離された瞬間
+};
+
+// コンパイル中の状態
+struct Compiler {
+  ProgramData program;
+  std::map<std::string, std::uint32_t, std::less<>> string_index;
+  std::map<std::string, std::uint32_t, std::less<>> symbol_index;
+};
+
+// コマンド列をバイトコードに変換
+// 数値はここで一度だけ解釈し、文字列とシンボルはプールのインデックスに置き換える
+Program compile(const std::vector<Command>& commands);
+
+// スクリプト文字列を直接バイトコードに変換
+Program compile_source(std::string_view source);
+
+// スクリプトをlabel行ごとに区切ったまとまり。変わったブロックだけコンパイルし直す
+struct ScriptBlock {
+  std::string source;   // ブロックの文字列(変わったかどうかの比較に使う)
+  std::uint32_t label;  // 先頭のラベル名のシンボル
+  ProgramData data;     // ラベル未解決のバイトコード(文字列とシンボルはScriptCacheのプールを指す)
+  std::uint32_t start;  // 直近にリンクしたプログラムでの先頭の命令位置
+};
+
+// リロードをまたいで持ち続けるコンパイル結果
+// 文字列とシンボルのプールは追加するだけなので、一度振ったインデックスは変わらない
+// (テクスチャや変数などインデックスを添字にした状態をそのまま使い続けられる)
+struct ScriptCache {
+  Compiler compiler;
+  std::vector<ScriptBlock> blocks;
+  std::size_t code_size;
+};
+
+// スクリプト文字列を読み直し、前回から変わったブロックだけコンパイルし直す
+// position_mapには前回のプログラムの命令位置(と末尾)から新しいプログラムの命令位置への対応を返す
+// 変わっていないブロックの中は同じ命令に、変わったブロックの中は同じラベルの先頭に、
+// 無くなったブロックの中はプログラムの先頭に対応させる
+Program update_script(ScriptCache& cache, std::string_view source, std::vector<std::uint32_t>& position_map);
+
+// バイトコードを命令ごとに出力する(デバッグ用)
+void dump_program(const Program& program);
+
+// コンパイル済みのスクリプトをファイルに書き出す
+bool save_program(const Program& program, const std::string& path);
+
+// コンパイル済みのスクリプトをmmapして読み込む(中身はコピーしない)
+std::optional<Program> load_program(const std::string& path);
+
+// CommandNameに対応するコマンド名
+const char* command_name(CommandName op);
+
+#endif // SCRIPT_H
@@ -0,0 +1,106 @@
+#include "text.h"                     // 文字列の描画に使うグリフアトラス
+#include "assets.h"                   // 画像の読み込みとテクスチャの管理
+
+// UTF-8の文字列からposの位置の1文字(コードポイント)を取り出し、posを次の文字に進める
+std::uint32_t next_codepoint(std::string_view str, std::size_t& pos) {
+  unsigned char c = str[pos++];
+  int extra = c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : c >= 0xC0 ? 1 : 0;
+  std::uint32_t cp = extra == 0 ? c : c & (0x3F >> extra);
+  for (int i = 0; i < extra && pos < str.size(); i++) {
+    cp = (cp << 6) | (static_cast<unsigned char>(str[pos++]) & 0x3F);
+  }
+  return cp;
+}
+
+bool init_glyph_atlas(SDL_Renderer* renderer, GlyphAtlas& atlas, const std::string& font_path) {
+  atlas.font = TTF_OpenFont(font_path.c_str(), FONT_SIZE);
+  if (atlas.font == NULL) {
+    std::cerr << "font: " << font_path << " could not be opened, so 'text' commands draw nothing (pass a TTF file with --font). TTF_Error: "
+              << TTF_GetError() << std::endl;
+    return false;
+  }
+  atlas.tex = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STATIC,
+                                GLYPH_ATLAS_SIZE, GLYPH_ATLAS_SIZE);
+  SDL_SetTextureBlendMode(atlas.tex, SDL_BLENDMODE_BLEND);
+  // フィルタリングで文字の周りの未初期化の部分が混ざらないよう透明で埋めておく
+  std::vector<Uint32> clear(GLYPH_ATLAS_SIZE * GLYPH_ATLAS_SIZE, 0);
+  SDL_UpdateTexture(atlas.tex, NULL, clear.data(), GLYPH_ATLAS_SIZE * sizeof(Uint32));
+  atlas.shelf_x = atlas.shelf_y = atlas.shelf_h = 0;
+  return true;
+}
+
+void destroy_glyph_atlas(GlyphAtlas& atlas) {
+  if (atlas.tex != NULL) SDL_DestroyTexture(atlas.tex);
+  if (atlas.font != NULL) TTF_CloseFont(atlas.font);
+  atlas.tex = NULL;
+  atlas.font = NULL;
+}
+
+// 1文字をラスタライズしてアトラスに描き込む(描き込み済みならそれを返す)
+const GlyphInfo* rasterize_glyph(GlyphAtlas& atlas, std::uint32_t cp) {
+  auto found = atlas.glyphs.find(cp);
+  if (found != atlas.glyphs.end()) return &found->second;
+
+  int advance = 0;
+  TTF_GlyphMetrics32(atlas.font, cp, NULL, NULL, NULL, NULL, &advance);
+  SDL_Color white{255, 255, 255, 255};
+  SDL_Surface* rendered = TTF_RenderGlyph32_Blended(atlas.font, cp, white);
+  if (rendered == NULL) return NULL;
+  SDL_Surface* glyph = SDL_ConvertSurfaceFormat(rendered, SDL_PIXELFORMAT_ARGB8888, 0);
+  SDL_FreeSurface(rendered);
+  if (glyph == NULL) return NULL;
+
+  if (atlas.shelf_x + glyph->w + ATLAS_PADDING > GLYPH_ATLAS_SIZE) {
+    atlas.shelf_x = 0;
+    atlas.shelf_y += atlas.shelf_h;
+    atlas.shelf_h = 0;
+  }
+  if (atlas.shelf_y + glyph->h + ATLAS_PADDING > GLYPH_ATLAS_SIZE) {
+    std::cerr << "glyph atlas is full." << std::endl;
+    SDL_FreeSurface(glyph);
+    return NULL;
+  }
+  SDL_Rect rect{atlas.shelf_x, atlas.shelf_y, glyph->w, glyph->h};
+  SDL_UpdateTexture(atlas.tex, &rect, glyph->pixels, glyph->pitch);
+  atlas.shelf_x += glyph->w + ATLAS_PADDING;
+  atlas.shelf_h = std::max(atlas.shelf_h, glyph->h + ATLAS_PADDING);
+  SDL_FreeSurface(glyph);
+
+  GlyphInfo info{make_region(atlas.tex, rect, GLYPH_ATLAS_SIZE, GLYPH_ATLAS_SIZE), advance};
+  return &atlas.glyphs.emplace(cp, info).first->second;
+}
+
+void layout_string(GlyphAtlas& atlas, std::string_view str, TextLayout& layout) {
+  layout.regions.clear();
+  layout.rects.clear();
+  if (atlas.font == NULL) return;
+  int pen_x = 0, pen_y = 0;
+  for (std::size_t pos = 0; pos < str.size();) {
+    std::uint32_t cp = next_codepoint(str, pos);
+    if (cp == '\n') {
+      pen_x = 0;
+      pen_y += TTF_FontLineSkip(atlas.font);
+      continue;
+    }
+    const GlyphInfo* glyph = rasterize_glyph(atlas, cp);
+    if (glyph == NULL) continue;
+    layout.regions.push_back(glyph->region);
+    layout.rects.push_back(SDL_Rect{pen_x, pen_y, glyph->region.src.w, glyph->region.src.h});
+    pen_x += glyph->advance;
+  }
+}
+
+void layout_texts(GlyphAtlas& atlas, const Program& program) {
+  atlas.layouts.assign(program.strings.size(), TextLayout{});
+  if (atlas.font == NULL) return;
+
+  std::vector<bool> done(program.strings.size(), false);
+  for (const auto& inst : program.code) {
+    if (inst.op != TEXT) continue;
+    std::uint32_t string_index = program.operands[inst.operand_begin].index;
+    if (done[string_index]) continue;
+    done[string_index] = true;
+
+    layout_string(atlas, program.strings[string_index], atlas.layouts[string_index]);
+  }
+}
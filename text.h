@@ -0,0 +1,18 @@
+// 文字列の描画に使うグリフアトラス
+#ifndef TEXT_H
+#define TEXT_H
+
+#include "engine.h"                   // エンジン全体で使う型と定数
+
+// フォントを開いてグリフアトラスを用意する(フォントが無ければtextコマンドは何も表示しない)
+bool init_glyph_atlas(SDL_Renderer* renderer, GlyphAtlas& atlas, const std::string& font_path);
+
+void destroy_glyph_atlas(GlyphAtlas& atlas);
+
+// 文字列の各文字をグリフアトラスから引いて並べる('\n'で次の行に移る)
+void layout_string(GlyphAtlas& atlas, std::string_view str, TextLayout& layout);
+
+// スクリプト中のtextコマンドの文字列を並べておく
+void layout_texts(GlyphAtlas& atlas, const Program& program);
+
+#endif // TEXT_H
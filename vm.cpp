@@ -0,0 +1,295 @@
+#include "vm.h"                       // コマンドとスクリプトの実行
+#include "script.h"                   // スクリプトの解釈とコンパイル
+#include "metrics.h"                  // 運用中の計測値
+#include "assets.h"                   // 画像の読み込みとテクスチャの管理
+#include "render.h"                   // 画像と文字列の描画
+
+std::map<std::string, CommandName, std::less<>> COMMAND_MAP = {
+  {"label", LABEL},
+  {"image", IMAGE},
+  {"clear", CLEAR},
+  {"text", TEXT},
+  {"goto", GOTO},
+  {"set", SET},
+  {"input", INPUT},
+  {"if", IF},
+  {"return", RETURN},
+  {"wait", WAIT},
+  {"spawn", SPAWN}
+};
+
+int command_nop(SDL_Renderer* renderer, EngineState& state, const Program& program, OperandView ops) {
+  return 0;
+}
+
+// 全てのコマンドをcommand_nopで埋めた関数表を作る
+std::array<CommandFn, MAX_COMMANDS> make_command_fn_map() {
+  std::array<CommandFn, MAX_COMMANDS> table;
+  table.fill(command_nop);
+  return table;
+}
+
+std::array<CommandFn, MAX_COMMANDS> COMMAND_FN_MAP = make_command_fn_map();
+int REGISTERED_COMMAND_COUNT = COMMAND_COUNT;
+
+std::optional<CommandName> register_command(const std::string& name, CommandFn fn) {
+  if (COMMAND_MAP.count(name) || REGISTERED_COMMAND_COUNT >= MAX_COMMANDS) return std::nullopt;
+  CommandName id = static_cast<CommandName>(REGISTERED_COMMAND_COUNT++);
+  COMMAND_MAP.emplace(name, id);
+  COMMAND_FN_MAP[id] = fn;
+  return id;
+}
+
+// 数値として使うオペランドの値を取得(シンボルは変数として値を引く)
+inline double operand_value(const EngineState& state, const Operand& operand) {
+  if (operand.kind == OPERAND_SYMBOL) return state.variables[operand.index];
+  return operand.number;
+}
+
+// コンパイル済みの式を評価する(スタックは固定長の配列なのでメモリを確保しない)
+double eval_expression(const Program& program, const EngineState& state, std::uint32_t expr_index) {
+  const Expression& expr = program.expressions[expr_index];
+  const ExprInstr* code = program.expr_code.data() + expr.begin;
+  double stack[EXPR_STACK_SIZE];
+  std::uint32_t sp = 0;
+  for (std::uint32_t i = 0; i < expr.count; i++) {
+    const ExprInstr& instr = code[i];
+    switch (instr.op) {
+    case EXPR_CONST: stack[sp++] = instr.value; break;
+    case EXPR_LOAD: stack[sp++] = state.variables[instr.slot]; break;
+    case EXPR_NEG: stack[sp - 1] = -stack[sp - 1]; break;
+    default:
+      sp -= 1;
+      stack[sp - 1] = apply_binary(instr.op, stack[sp - 1], stack[sp]);
+      break;
+    }
+  }
+  return stack[0];
+}
+
+int command_image(SDL_Renderer* renderer, EngineState& state, const Program& program, OperandView ops) {
+  std::uint32_t path_index = ops[1].index;
+  const TextureRegion* found = &state.assets->textures[path_index];
+
+  TextureCache& cache = state.assets->texture_cache;
+  if (cache.enabled && state.parallel) {
+    // 並列実行中は共有のキャッシュに触らず、使った画像を後でまとめて知らせる(無ければ今回は表示しない)
+    state.texture_requests.push_back(path_index);
+    if (found->tex == NULL) return 0;
+  } else if (cache.enabled) {
+    if (found->tex != NULL) {
+      cache.hits += 1;
+    } else {
+      cache.misses += 1;
+      found = &fetch_texture(renderer, state, program, path_index);
+    }
+    cache.last_used[path_index] = ++cache.clock;
+  }
+  const TextureRegion& region = *found;
+
+  if (region.tex == NULL) {
+    std::cerr << "'image': " << program.strings[ops[1].index] << " is not loaded." << std::endl;
+    return 1;
+  }
+
+  SDL_Rect rect;
+  rect.x = operand_value(state, ops[2]);
+  rect.y = operand_value(state, ops[3]);
+  if (ops.size >= 6) {
+    rect.w = operand_value(state, ops[4]);
+    rect.h = operand_value(state, ops[5]);
+  } else {
+    // 大きさが省略されたら画像の大きさで表示する
+    rect.w = region.src.w;
+    rect.h = region.src.h;
+  }
+  std::int32_t z = ops.size == 7 ? static_cast<std::int32_t>(operand_value(state, ops[6])) : 0;
+
+  // この命令が前回書いたスロットを覚えておき、id→スロットの表を引かずに直接比べて書き換える
+  // (実行位置は実行前に次の命令へ進めてある)
+  if (state.image_slots.size() != program.code.size()) state.image_slots.assign(program.code.size(), -1);
+  std::int32_t& cached = state.image_slots[state.command_index - 1];
+  SpriteStore& sprites = state.sprites;
+  std::uint32_t id = ops[0].index;
+  if (cached >= 0 && static_cast<std::size_t>(cached) < sprites.ids.size() && sprites.ids[cached] == id) {
+    update_sprite(sprites, cached, region, rect, z);
+  } else {
+    cached = set_sprite(sprites, id, region, rect, z);
+  }
+  return 0;
+}
+
+int command_text(SDL_Renderer* renderer, EngineState& state, const Program& program, OperandView ops) {
+  std::uint32_t string_index = ops[0].index;
+  SDL_Point pos{static_cast<int>(operand_value(state, ops[1])), static_cast<int>(operand_value(state, ops[2]))};
+
+  // フォントが無いと何も表示されないので、最初に実行したときに知らせる(並列実行中はアトラスに書かない)
+  GlyphAtlas& atlas = state.assets->glyph_atlas;
+  if (atlas.font == NULL && !atlas.font_warned && !state.parallel) {
+    std::cerr << "'text': no font is loaded, so \"" << program.strings[string_index]
+              << "\" is not drawn (pass a TTF file with --font)." << std::endl;
+    atlas.font_warned = true;
+  }
+  if (set_text(state.texts, string_index, string_index, pos)) state.sprites.changed = true;
+  return 0;
+}
+
+int command_goto(SDL_Renderer* renderer, EngineState& state, const Program& program, OperandView ops) {
+  if (ops[0].kind != OPERAND_LABEL) return 1;
+  state.command_index = ops[0].index;
+  return 0;
+}
+
+// 戻り先を積んでラベルに飛ぶ(inputとifが条件を満たしたときに使う)
+int call_label(EngineState& state, const Program& program, const Operand& target) {
+  if (target.kind != OPERAND_LABEL) return 1;
+  if (state.call_depth >= CALL_STACK_SIZE) {
+    std::cerr << "call stack overflow." << std::endl;
+    return 1;
+  }
+  state.call_stack[state.call_depth++] = state.command_index;
+  state.command_index = target.index;
+  return 0;
+}
+
+int command_input(SDL_Renderer* renderer, EngineState& state, const Program& program, OperandView ops) {
+  std::size_t code = static_cast<std::size_t>(ops[0].number);
+  const InputState& input = state.input;
+  bool hit = false;
+  switch (static_cast<InputMode>(ops[2].number)) {
+  case INPUT_HELD: hit = input.current[code]; break;
+  case INPUT_PRESSED: hit = input.current[code] && !input.previous[code]; break;
+  case INPUT_RELEASED: hit = !input.current[code] && input.previous[code]; break;
+  }
+  if (!hit) return 0;
+  return call_label(state, program, ops[1]);
+}
+
+int command_set(SDL_Renderer* renderer, EngineState& state, const Program& program, OperandView ops) {
+  state.variables[ops[0].index] = eval_expression(program, state, ops[1].index);
+  return 0;
+}
+
+int command_if(SDL_Renderer* renderer, EngineState& state, const Program& program, OperandView ops) {
+  if (eval_expression(program, state, ops[0].index) == 0.0) return 0;
+  return call_label(state, program, ops[1]);
+}
+
+int command_return(SDL_Renderer* renderer, EngineState& state, const Program& program, OperandView ops) {
+  if (state.call_depth == 0) {
+    std::cerr << "'return' without a call." << std::endl;
+    return 1;
+  }
+  state.command_index = state.call_stack[--state.call_depth];
+  return 0;
+}
+
+int command_wait(SDL_Renderer* renderer, EngineState& state, const Program& program, OperandView ops) {
+  double frames = ops.size == 1 ? operand_value(state, ops[0]) : 1.0;
+  state.wait_frames = frames > 1.0 ? static_cast<std::uint32_t>(frames) - 1 : 0;
+  state.yield = true;
+  return 0;
+}
+
+int command_log(SDL_Renderer* renderer, EngineState& state, const Program& program, OperandView ops) {
+  for (std::size_t i = 0; i < ops.size; i++) {
+    const Operand& operand = ops[i];
+    if (i > 0) std::cout << " ";
+    if (operand.kind == OPERAND_STRING) {
+      std::cout << program.strings[operand.index];
+    } else if (operand.kind == OPERAND_SYMBOL) {
+      std::cout << program.symbols[operand.index] << "=" << state.variables[operand.index];
+    } else {
+      std::cout << operand.number;
+    }
+  }
+  std::cout << std::endl;
+  return 0;
+}
+
+int command_spawn(SDL_Renderer* renderer, EngineState& state, const Program& program, OperandView ops) {
+  if (ops[0].kind != OPERAND_LABEL) return 1;
+  double count = ops.size == 2 ? operand_value(state, ops[1]) : 1.0;
+  for (int i = 0; i < count && i < static_cast<int>(MAX_ACTORS); i++) state.spawn_requests.push_back(ops[0].index);
+  return 0;
+}
+
+#ifdef ENGINE_TRACY
+// ラベルの区間を表すTracyのゾーン(名前が実行時に決まり、開始と終了が別の命令なのでCのAPIで開く)
+struct LabelZone {
+  TracyCZoneCtx ctx;
+  bool open;
+};
+
+const ___tracy_source_location_data LABEL_ZONE_LOCATION{"label", "run_script", __FILE__, __LINE__, 0};
+
+// 次に実行する命令がラベルの直後なら(ラベル命令を通ったか、ラベルに飛んだ)、前の区間を閉じてそのラベルの区間を開く
+void enter_label_zone(LabelZone& zone, const Program& program, std::size_t next) {
+  if (next == 0 || next > program.code.size() || program.code[next - 1].op != LABEL) return;
+  if (zone.open) TracyCZoneEnd(zone.ctx);
+  std::string_view name = program.symbols[program.operands[program.code[next - 1].operand_begin].index];
+  zone.ctx = ___tracy_emit_zone_begin(&LABEL_ZONE_LOCATION, 1);
+  TracyCZoneName(zone.ctx, name.data(), name.size());
+  zone.open = true;
+}
+
+void close_label_zone(LabelZone& zone) {
+  if (zone.open) TracyCZoneEnd(zone.ctx);
+  zone.open = false;
+}
+
+#define ENGINE_LABEL_ZONE(zone) LabelZone zone{}
+#define ENGINE_LABEL_ZONE_ENTER(zone, program, next) enter_label_zone(zone, program, next)
+#define ENGINE_LABEL_ZONE_CLOSE(zone) close_label_zone(zone)
+#else
+#define ENGINE_LABEL_ZONE(zone)
+#define ENGINE_LABEL_ZONE_ENTER(zone, program, next)
+#define ENGINE_LABEL_ZONE_CLOSE(zone)
+#endif
+
+std::uint32_t run_script(SDL_Renderer* renderer, EngineState& state, const Program& program, std::uint64_t budget_us, Profiler& profiler) {
+  ENGINE_ZONE("script");
+  state.frame += 1;
+  if (state.wait_frames > 0) {
+    state.wait_frames -= 1;
+    return 0;
+  }
+
+  const Uint64 start = SDL_GetPerformanceCounter();
+  const Uint64 budget = budget_us * SDL_GetPerformanceFrequency() / 1000000;
+  std::uint32_t executed = 0;
+  state.yield = false;
+  ENGINE_LABEL_ZONE(label_zone);
+  ENGINE_LABEL_ZONE_ENTER(label_zone, program, state.command_index);
+
+  while (state.command_index < program.code.size()) {
+    const Instruction& inst = program.code[state.command_index];
+    if (inst.op == INPUT) {
+      if (state.executed_frames[state.command_index] == state.frame) break;
+      state.executed_frames[state.command_index] = state.frame;
+    }
+    // 分岐命令が書き換えられるよう、実行前に次の位置へ進めておく
+    std::size_t index = state.command_index;
+    state.command_index += 1;
+    if (profiler.enabled) {
+      Uint64 begin = SDL_GetPerformanceCounter();
+      execute(renderer, state, program, inst);
+      profile_command(profiler, inst.op, index, begin, SDL_GetPerformanceCounter());
+    } else {
+      execute(renderer, state, program, inst);
+    }
+    ENGINE_LABEL_ZONE_ENTER(label_zone, program, state.command_index);
+    if (state.yield) break;
+
+    executed += 1;
+    if (state.instruction_budget > 0) {
+      if (executed >= state.instruction_budget) break;
+    } else if (executed % BUDGET_CHECK_INTERVAL == 0 && SDL_GetPerformanceCounter() - start >= budget) {
+      break;
+    }
+  }
+  ENGINE_LABEL_ZONE_CLOSE(label_zone);
+  flush_profile_span(profiler);
+  add_metric(METRIC_COMMANDS, executed);
+  return executed;
+}
@@ -0,0 +1,70 @@
+// コマンドとスクリプトの実行
+#ifndef VM_H
+#define VM_H
+
+#include "engine.h"                   // エンジン全体で使う型と定数
+#include "profiler.h"                 // フレーム時間とプロファイラ
+
+// CommandNameを添字として引く関数表
+// 組み込みコマンドはCOMMAND_FN_MAP[IMAGE] = command_imageのように直接登録する
+extern std::array<CommandFn, MAX_COMMANDS> COMMAND_FN_MAP;
+// 組み込みと追加したコマンドを合わせた種類数
+extern int REGISTERED_COMMAND_COUNT;
+
+// スクリプトから呼べるコマンドを名前で追加し、割り当てたCommandNameを返す
+// 引数はコンパイル時に検査されず、数値・文字列・シンボルのオペランドのままfnに渡される
+// コンパイル済みのファイルには番号で残るので、読み込むときも同じ順に追加しておく
+std::optional<CommandName> register_command(const std::string& name, CommandFn fn);
+
+// 画像を表示するコマンド
+// image id "パス" x y [w h [z]]
+int command_image(SDL_Renderer* renderer, EngineState& state, const Program& program, OperandView ops);
+
+// 文字列を表示するコマンド(同じ文字列をもう一度表示すると位置が変わる)
+// text "文字列" x y
+int command_text(SDL_Renderer* renderer, EngineState& state, const Program& program, OperandView ops);
+
+// ラベルに飛ぶコマンド
+int command_goto(SDL_Renderer* renderer, EngineState& state, const Program& program, OperandView ops);
+
+// キーの状態を調べ、条件を満たしていればラベルを呼び出すコマンド
+// スナップショットを見るだけなので、1フレームに何度調べてもイベントを取りに行かない
+int command_input(SDL_Renderer* renderer, EngineState& state, const Program& program, OperandView ops);
+
+// 変数に式の値を入れるコマンド
+// set 変数 式
+int command_set(SDL_Renderer* renderer, EngineState& state, const Program& program, OperandView ops);
+
+// 式の値が0でなければラベルを呼び出すコマンド
+// if 式 ラベル
+int command_if(SDL_Renderer* renderer, EngineState& state, const Program& program, OperandView ops);
+
+// 最後に呼ばれたラベルの呼び出し元に戻るコマンド
+int command_return(SDL_Renderer* renderer, EngineState& state, const Program& program, OperandView ops);
+
+// 指定したフレーム数だけ待つコマンド(引数を省略すると1フレーム)
+int command_wait(SDL_Renderer* renderer, EngineState& state, const Program& program, OperandView ops);
+
+// 引数を順に標準出力に書き出す(シンボルは変数の名前と値を書く)
+// register_commandで追加するコマンドの例を兼ねる
+int command_log(SDL_Renderer* renderer, EngineState& state, const Program& program, OperandView ops);
+
+// アクターを生み出すコマンド(作るのはこのロジック更新のスクリプト実行が終わってから)
+// spawn ラベル [数]
+int command_spawn(SDL_Renderer* renderer, EngineState& state, const Program& program, OperandView ops);
+
+// 命令を1つ実行する(関数表をコマンド名の添字で引いて呼び出す)
+inline int execute(SDL_Renderer* renderer, EngineState& state, const Program& program, const Instruction& inst) {
+  OperandView ops{program.operands.data() + inst.operand_begin, inst.operand_count};
+  return COMMAND_FN_MAP[inst.op](renderer, state, program, ops);
+}
+
+// 1フレーム分のスクリプトを実行する
+// 命令がフレームを譲るか、予算時間(state.instruction_budgetが0でなければその命令数)を使い切るか、
+// 命令列が終わるまで続けて実行する
+// inputは同じフレームに同じ命令を二度実行しようとした時点でフレームを譲る
+// profilerが有効なら命令ごとに実行時間を測る。実行した命令の数を返す
+// (Tracyのゾーンは1回の実行全体とラベルの区間ごとに開き、命令ごとの時間はprofilerに任せる)
+std::uint32_t run_script(SDL_Renderer* renderer, EngineState& state, const Program& program, std::uint64_t budget_us, Profiler& profiler);
+
+#endif // VM_H